@@ -0,0 +1,148 @@
+#ifndef _AABB_HPP__
+#define _AABB_HPP__
+
+#include <limits>
+
+#include <glm/glm.hpp>
+
+/**
+  * Axis aligned bounding box used by the acceleration structures. An empty box
+  * has min > max, so extending it with any point or box gives that point or box.
+  */
+struct AABB {
+	AABB()
+		: min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {
+	}
+	AABB(glm::vec3 min, glm::vec3 max)
+		: min(min), max(max) {
+	}
+
+	/**
+	  * Returns a box covering all of space, used for objects such as the cube map
+	  * that can not be bounded and therefore are kept out of the hierarchy
+	  */
+	static AABB infinite() {
+		return AABB(glm::vec3(-std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::max()));
+	}
+
+	inline bool isEmpty() const {
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+
+	inline bool isInfinite() const {
+		const float big = std::numeric_limits<float>::max();
+		return min.x <= -big || min.y <= -big || min.z <= -big
+			|| max.x >= big || max.y >= big || max.z >= big;
+	}
+
+	inline void extend(const glm::vec3& p) {
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	inline void extend(const AABB& b) {
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	/**
+	  * Returns the box common to this box and b, which is empty if they do not overlap
+	  */
+	inline AABB intersection(const AABB& b) const {
+		return AABB(glm::max(min, b.min), glm::min(max, b.max));
+	}
+
+	inline glm::vec3 centroid() const {
+		return 0.5f*(min+max);
+	}
+
+	inline glm::vec3 extent() const {
+		return max-min;
+	}
+
+	/**
+	  * Returns the axis (0=x, 1=y, 2=z) along which the box is largest
+	  */
+	inline int largestAxis() const {
+		glm::vec3 e = extent();
+		if (e.x > e.y && e.x > e.z) return 0;
+		return (e.y > e.z) ? 1 : 2;
+	}
+
+	/**
+	  * Surface area of the box, which is what the surface area heuristic uses
+	  * as the probability of a random ray hitting it
+	  */
+	inline float surfaceArea() const {
+		if (isEmpty()) return 0.0f;
+		glm::vec3 e = extent();
+		return 2.0f*(e.x*e.y + e.y*e.z + e.z*e.x);
+	}
+
+	/**
+	  * Slab test against a ray given by its origin and reciprocal direction.
+	  * @param t_max Intersections further away than this are rejected
+	  * @return true if the ray enters the box between 0 and t_max
+	  */
+	inline bool intersect(const glm::vec3& origin, const glm::vec3& inv_dir, float t_max) const {
+		glm::vec3 t1 = (min-origin)*inv_dir;
+		glm::vec3 t2 = (max-origin)*inv_dir;
+		glm::vec3 t_small = glm::min(t1, t2);
+		glm::vec3 t_large = glm::max(t1, t2);
+		float t_enter = glm::max(glm::max(t_small.x, t_small.y), glm::max(t_small.z, 0.0f));
+		float t_exit = glm::min(glm::min(t_large.x, t_large.y), glm::min(t_large.z, t_max));
+		return t_enter <= t_exit;
+	}
+
+	/**
+	  * Returns the bounds of the part of a convex planar polygon that lies inside
+	  * box, by clipping the polygon against the six planes of the box in turn
+	  * (Sutherland-Hodgman). Spatial splits use this to bound pieces of large
+	  * primitives much tighter than the overlap of the two boxes would.
+	  * @param count Number of corners, at most 10
+	  */
+	static AABB clipPolygon(const glm::vec3* polygon, unsigned int count, const AABB& box) {
+		glm::vec3 buffers[2][16];
+		unsigned int sizes[2] = { count, 0 };
+		for (unsigned int i=0; i<count; ++i) buffers[0][i] = polygon[i];
+
+		unsigned int current = 0;
+		for (int plane=0; plane<6; ++plane) {
+			const int axis = plane/2;
+			const bool is_max = (plane%2) == 1;
+			const float value = is_max ? box.max[axis] : box.min[axis];
+			const glm::vec3* in = buffers[current];
+			glm::vec3* out = buffers[1-current];
+			unsigned int in_size = sizes[current];
+			unsigned int out_size = 0;
+
+			for (unsigned int i=0; i<in_size; ++i) {
+				const glm::vec3& a = in[i];
+				const glm::vec3& b = in[(i+1)%in_size];
+				bool a_inside = is_max ? a[axis] <= value : a[axis] >= value;
+				bool b_inside = is_max ? b[axis] <= value : b[axis] >= value;
+				if (a_inside) out[out_size++] = a;
+				if (a_inside != b_inside) {
+					float s = (value - a[axis])/(b[axis] - a[axis]);
+					glm::vec3 p = a + s*(b-a);
+					p[axis] = value;
+					out[out_size++] = p;
+				}
+			}
+			current = 1-current;
+			sizes[current] = out_size;
+			if (out_size == 0) return AABB();
+		}
+
+		AABB clipped;
+		for (unsigned int i=0; i<sizes[current]; ++i) {
+			clipped.extend(buffers[current][i]);
+		}
+		return clipped.intersection(box);
+	}
+
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+#endif
@@ -0,0 +1,1209 @@
+#ifndef _BVH_HPP__
+#define _BVH_HPP__
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+
+#include <glm/glm.hpp>
+
+#include "AABB.hpp"
+#include "Ray.hpp"
+#include "SceneObject.hpp"
+#include "RadixSort.hpp"
+#include "RayPacket.hpp"
+#include "Frustum.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
+namespace bvh{
+	/**
+	  * Selects how the hierarchy is built when the scene is frozen
+	  */
+	enum BuildMode {
+		BuildQuality,      //< Top down binned SAH build. Slower to build, fastest to trace
+		BuildSpeed,        //< Parallel Morton code (LBVH) build. Builds in a fraction of the time
+		BuildSpatialSplits //< Binned SAH build that also splits large primitives between leaves (SBVH).
+		                   //  Slowest to build and uses more memory, fastest to trace for scenes
+		                   //  with long, thin or large overlapping triangles and planes
+	};
+}
+
+/**
+  * A node in the flattened hierarchy. Nodes are stored depth first, so the
+  * left child of an interior node is always the next node in the array and
+  * offset points to the right child. For leaves offset is the first primitive
+  * and count the number of primitives. 32 bytes, so two nodes per cache line.
+  */
+struct BVHNode {
+	AABB bounds;
+	unsigned int offset;
+	unsigned short count;
+	unsigned short axis;
+
+	inline bool isLeaf() const { return count > 0; }
+};
+
+/**
+  * Bounding volume hierarchy over the scene objects. It is either built top down
+  * using the binned surface area heuristic, or as a linear BVH by sorting the
+  * objects along a Morton curve, which is done in parallel on all cores.
+  *
+  * References:
+  *				Physically Based Rendering (2nd ed) "Bounding Volume Hierarchies" p208-235
+  *				Ingo Wald. 2007. On fast Construction of SAH-based Bounding Volume Hierarchies
+  *				Tero Karras. 2012. Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees
+  */
+class BVH {
+public:
+	BVH() : node_data(NULL), node_count(0), index_data(NULL), index_count(0) {}
+
+	/**
+	  * Builds the hierarchy over objects. Only objects with a finite bounding box
+	  * should be passed in, the rest can not be placed in the tree. The parallel
+	  * parts of the build run on pool, or on OpenMP threads if it is NULL.
+	  */
+	void build(const std::vector<std::shared_ptr<SceneObject> >& objects, bvh::BuildMode mode = bvh::BuildQuality, ThreadPool* pool = NULL) {
+		if (mode == bvh::BuildSpatialSplits) {
+			buildSpatial(objects);
+			return;
+		}
+
+		const int n = static_cast<int>(objects.size());
+		std::vector<AABB> boxes(n);
+		parallelFor(pool, 0, n, [&](int i) {
+			boxes[i] = objects[i]->getBoundingBox();
+		});
+		build(boxes, mode, pool);
+		setObjects(objects);
+	}
+
+	/**
+	  * Builds the hierarchy over primitives that are not scene objects, such as
+	  * the triangles of a mesh, from their bounding boxes. Leaves refer to the
+	  * primitives by their index in boxes, and the tree is walked with the
+	  * intersect() and occluded() overloads that are given the primitives.
+	  * Spatial splits need to clip the primitives, so that mode builds as BuildQuality.
+	  */
+	void build(const std::vector<AABB>& boxes, bvh::BuildMode mode = bvh::BuildQuality, ThreadPool* pool = NULL) {
+		if (mode == bvh::BuildSpeed) {
+			buildLinear(boxes, pool);
+			return;
+		}
+
+		clear();
+		if (boxes.empty()) return;
+
+		std::vector<BuildEntry> entries(boxes.size());
+		for (unsigned int i=0; i<boxes.size(); ++i) {
+			entries[i].bounds = boxes[i];
+			entries[i].centroid = entries[i].bounds.centroid();
+			entries[i].index = i;
+		}
+
+		nodes.reserve(2*boxes.size());
+		buildRecursive(entries, 0, static_cast<unsigned int>(entries.size()), 0);
+		//Leaves hold up to max_leaf_size primitives, so most of the reserve is unused
+		nodes.shrink_to_fit();
+
+		indices.resize(entries.size());
+		for (unsigned int i=0; i<entries.size(); ++i) {
+			indices[i] = entries[i].index;
+		}
+		useOwnedStorage();
+	}
+
+	/**
+	  * Uses nodes and primitive order stored elsewhere, normally in a memory mapped
+	  * cache file, without copying them. The arrays hold no pointers, only indices,
+	  * so they can be used as is at whatever address they are mapped to.
+	  * @param objects The objects in the same order as when the tree was built
+	  * @param storage Kept alive for as long as the tree uses the arrays
+	  */
+	void attach(const std::vector<std::shared_ptr<SceneObject> >& objects,
+		const BVHNode* node_array, unsigned int node_array_count,
+		const unsigned int* index_array, unsigned int index_array_count,
+		std::shared_ptr<MappedFile> storage) {
+		clear();
+		setObjects(objects);
+		node_data = node_array;
+		node_count = node_array_count;
+		index_data = index_array;
+		index_count = index_array_count;
+		mapping = storage;
+	}
+
+	void clear() {
+		nodes.clear();
+		indices.clear();
+		objects.clear();
+		mapping.reset();
+		useOwnedStorage();
+	}
+
+	/**
+	  * Builds a spatial split BVH (SBVH). Each node tries the usual object split,
+	  * and when its two children would overlap noticeably, also a split by a
+	  * plane through space that clips the objects crossing it into a piece on
+	  * each side. Large and thin primitives then end up in several small leaves
+	  * instead of stretching a few large boxes across the scene, so rays visit
+	  * fewer nodes, at the cost of leaves referencing some objects more than once.
+	  *
+	  * References:
+	  *				Martin Stich, Heiko Friedrich, Andreas Dietrich. 2009. Spatial Splits in Bounding Volume Hierarchies
+	  */
+	void buildSpatial(const std::vector<std::shared_ptr<SceneObject> >& objects) {
+		clear();
+		setObjects(objects);
+		if (objects.empty()) return;
+
+		std::vector<BuildEntry> refs(objects.size());
+		AABB root;
+		for (unsigned int i=0; i<objects.size(); ++i) {
+			refs[i].bounds = objects[i]->getBoundingBox();
+			refs[i].centroid = refs[i].bounds.centroid();
+			refs[i].index = i;
+			root.extend(refs[i].bounds);
+		}
+
+		//Overlap below 1e-5 of the scene's area is not worth a spatial split
+		//(Stich's alpha), and the references may at most double
+		const float min_overlap = 1e-5f*root.surfaceArea();
+		unsigned int budget = static_cast<unsigned int>(objects.size());
+
+		nodes.reserve(2*objects.size());
+		indices.reserve(objects.size());
+		buildSpatialRecursive(refs, 0, min_overlap, budget);
+		nodes.shrink_to_fit();
+		useOwnedStorage();
+	}
+
+	/**
+	  * Builds a linear BVH over the primitives with the given boxes: the
+	  * centroids are quantized to 30 bit Morton codes and radix sorted, after
+	  * which every internal node can find its own range and split independently
+	  * of the others. Node positions in the depth first array and node bounds are
+	  * then also computed in parallel. All leaves hold a single primitive.
+	  */
+	void buildLinear(const std::vector<AABB>& boxes, ThreadPool* pool = NULL) {
+		clear();
+		if (boxes.empty()) return;
+
+		const int n = static_cast<int>(boxes.size());
+		std::vector<glm::vec3> centroids(n);
+
+		parallelFor(pool, 0, n, [&](int i) {
+			centroids[i] = boxes[i].centroid();
+		});
+
+		AABB centroid_bounds;
+		for (int i=0; i<n; ++i) {
+			centroid_bounds.extend(centroids[i]);
+		}
+		glm::vec3 extent = centroid_bounds.extent();
+		glm::vec3 scale(extent.x > 0.0f ? 1.0f/extent.x : 0.0f,
+						extent.y > 0.0f ? 1.0f/extent.y : 0.0f,
+						extent.z > 0.0f ? 1.0f/extent.z : 0.0f);
+
+		std::vector<unsigned int> codes(n);
+		std::vector<unsigned int> order(n);
+		parallelFor(pool, 0, n, [&](int i) {
+			codes[i] = mortonCode((centroids[i]-centroid_bounds.min)*scale);
+			order[i] = i;
+		});
+		parallelRadixSort(codes, order, 30, pool);
+
+		indices.resize(n);
+		nodes.resize(2*n-1);
+		if (n == 1) {
+			indices[0] = 0;
+			nodes[0].bounds = boxes[0];
+			makeLeaf(0, 0, 1);
+			useOwnedStorage();
+			return;
+		}
+
+		//Karras' hierarchy: internal node i and leaf i are numbered separately.
+		//Children with index >= n-1 below refer to leaf (index-(n-1)).
+		const int internal_count = n-1;
+		std::vector<int> first(2*n-1), last(2*n-1), left(internal_count), right(internal_count), parent(2*n-1);
+		std::vector<unsigned short> axis(internal_count);
+		parent[0] = -1;
+
+		parallelFor(pool, 0, internal_count, [&](int i) {
+			//Direction of the range this node covers, and its far end
+			int d = (prefixLength(codes, i, i+1) - prefixLength(codes, i, i-1)) >= 0 ? 1 : -1;
+			int delta_min = prefixLength(codes, i, i-d);
+			int l_max = 2;
+			while (prefixLength(codes, i, i+l_max*d) > delta_min) l_max *= 2;
+			int l = 0;
+			for (int t=l_max/2; t>=1; t/=2) {
+				if (prefixLength(codes, i, i+(l+t)*d) > delta_min) l += t;
+			}
+			int j = i+l*d;
+
+			//Binary search for the split, where the common prefix ends
+			int delta_node = prefixLength(codes, i, j);
+			int s = 0;
+			int t = l;
+			do {
+				t = (t+1)/2;
+				if (prefixLength(codes, i, i+(s+t)*d) > delta_node) s += t;
+			} while (t > 1);
+			int gamma = i+s*d+glm::min(d, 0);
+
+			int lo = glm::min(i, j);
+			int hi = glm::max(i, j);
+			first[i] = lo;
+			last[i] = hi;
+			left[i] = (lo == gamma) ? internal_count+gamma : gamma;
+			right[i] = (hi == gamma+1) ? internal_count+gamma+1 : gamma+1;
+			parent[left[i]] = i;
+			parent[right[i]] = i;
+
+			//The split is on the highest differing Morton bit, which tells the axis
+			unsigned int diff = codes[lo] ^ codes[hi];
+			axis[i] = (diff == 0) ? 0 : static_cast<unsigned short>(2 - highestBit(diff)%3);
+		});
+		parallelFor(pool, 0, n, [&](int i) {
+			first[internal_count+i] = i;
+			last[internal_count+i] = i;
+		});
+
+		//A node's depth first position is the number of ancestors plus the size of
+		//every subtree to its left. Those subtrees cover exactly the leaves before
+		//the node's range, and a subtree over m leaves has 2m-1 nodes.
+		std::vector<unsigned int> position(2*n-1);
+		parallelFor(pool, 0, 2*n-1, [&](int k) {
+			int depth = 0;
+			int right_turns = 0;
+			for (int c=k, p=parent[k]; p >= 0; c=p, p=parent[p]) {
+				depth++;
+				if (right[p] == c) right_turns++;
+			}
+			position[k] = depth + 2*first[k] - right_turns;
+		});
+
+		//Leaves first, then bounds bottom up: the second child to finish an
+		//internal node computes its bounds and continues towards the root
+		std::unique_ptr<boost::atomic<int>[]> visits(new boost::atomic<int>[internal_count]);
+		for (int i=0; i<internal_count; ++i) visits[i] = 0;
+
+		parallelFor(pool, 0, n, [&](int i) {
+			unsigned int leaf_position = position[internal_count+i];
+			indices[i] = order[i];
+			nodes[leaf_position].bounds = boxes[order[i]];
+			makeLeaf(leaf_position, i, 1);
+
+			int p = parent[internal_count+i];
+			while (p >= 0 && visits[p].fetch_add(1) == 1) {
+				BVHNode& node = nodes[position[p]];
+				node.bounds = nodes[position[left[p]]].bounds;
+				node.bounds.extend(nodes[position[right[p]]].bounds);
+				node.offset = position[right[p]];
+				node.count = 0;
+				node.axis = axis[p];
+				p = parent[p];
+			}
+		});
+		useOwnedStorage();
+	}
+
+	/**
+	  * For trees built from boxes: once the caller has stored its primitives in
+	  * the order of getIndexData(), makes leaf position i refer to primitive i.
+	  * Leaves then read their primitives from consecutive memory.
+	  */
+	void useLeafOrder() {
+		for (unsigned int i=0; i<indices.size(); ++i) {
+			indices[i] = i;
+		}
+	}
+
+	/**
+	  * Updates the node bounds after objects have moved, keeping the tree
+	  * topology. Children are always stored after their parent, so one pass
+	  * from the back of the node array sees every child before its parent.
+	  * Leaves from spatial splits get the whole box of their objects back.
+	  * Only trees built from scene objects can be refitted.
+	  */
+	void refit() {
+		if (objects.empty()) return;
+
+		if (mapping) {
+			//Mapped cache files are read only, so refitting works on a copy
+			nodes.assign(node_data, node_data+node_count);
+			indices.assign(index_data, index_data+index_count);
+			mapping.reset();
+			useOwnedStorage();
+		}
+
+		for (int k=static_cast<int>(nodes.size())-1; k>=0; --k) {
+			BVHNode& node = nodes[k];
+			if (node.isLeaf()) {
+				node.bounds = AABB();
+				for (unsigned int i=node.offset; i<node.offset+node.count; ++i) {
+					node.bounds.extend(getPrimitive(i)->getBoundingBox());
+				}
+			}
+			else {
+				node.bounds = nodes[k+1].bounds;
+				node.bounds.extend(nodes[node.offset].bounds);
+			}
+		}
+	}
+
+	/**
+	  * Expected cost of tracing a random ray through the tree according to the
+	  * surface area heuristic, in units of primitive intersection tests. Refitting
+	  * moving objects makes the boxes overlap more, which shows up as a higher cost.
+	  */
+	float sahCost() const {
+		if (node_count == 0) return 0.0f;
+		float root_area = node_data[0].bounds.surfaceArea();
+		if (root_area <= 0.0f) return 0.0f;
+
+		float cost = 0.0f;
+		for (unsigned int k=0; k<node_count; ++k) {
+			float area = node_data[k].bounds.surfaceArea();
+			cost += area*(node_data[k].isLeaf() ? node_data[k].count : traversalCost());
+		}
+		return cost/root_area;
+	}
+
+	inline bool empty() const { return node_count == 0; }
+	inline const BVHNode* getNodeData() const { return node_data; }
+	inline unsigned int getNodeCount() const { return node_count; }
+	inline const unsigned int* getIndexData() const { return index_data; }
+	inline unsigned int getObjectCount() const { return static_cast<unsigned int>(objects.size()); }
+
+	/**
+	  * Number of object references in the leaves. Larger than the object count
+	  * when spatial splits have placed objects in more than one leaf.
+	  */
+	inline unsigned int getIndexCount() const { return index_count; }
+
+	/**
+	  * Returns the object at position i in leaf order
+	  */
+	inline SceneObject* getPrimitive(unsigned int i) const { return objects[index_data[i]]; }
+
+	/**
+	  * Returns object index, as passed to primitives and returned by the traversal templates
+	  */
+	inline SceneObject* getObject(unsigned int index) const { return objects[index]; }
+
+	/**
+	  * Deepest tree the builders produce, and so the traversal stack size
+	  */
+	static const unsigned int max_depth = 64;
+
+	/**
+	  * Most subtrees cull() splits the visible part of the tree into
+	  */
+	static const unsigned int max_cull_entries = 16;
+
+	/**
+	  * Finds the closest intersection along ray
+	  * @param t_near Intersections closer than this are ignored (self intersection offset)
+	  * @param t_min In: the closest hit found so far. Out: the closest hit found
+	  * @param hit Set to the object that was hit, if any hit closer than t_min was found
+	  * @return true if a closer hit than the incoming t_min was found
+	  */
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, SceneObject*& hit) const {
+		unsigned int index;
+		if (!intersect(ray, t_near, t_min, index, ObjectPrimitives(objects))) return false;
+		hit = objects[index];
+		return true;
+	}
+
+	/**
+	  * Tests whether anything intersects ray between t_near and t_max, stopping
+	  * at the first such intersection instead of looking for the closest one
+	  */
+	inline bool occluded(const Ray& ray, float t_near, float t_max) const {
+		return occluded(ray, t_near, t_max, ObjectPrimitives(objects));
+	}
+
+	/**
+	  * Finds the closest intersection along ray for a tree built from boxes.
+	  * primitives.intersect(index, ray) must return the ray parameter of the hit
+	  * with primitive index, or a negative number for a miss.
+	  * @param hit Set to the index of the primitive that was hit
+	  */
+	template <class Primitives>
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit, const Primitives& primitives) const {
+		if (node_count == 0) return false;
+		return intersectSubtree(0, ray, t_near, t_min, hit, primitives);
+	}
+
+	/**
+	  * Finds the subtrees that can hold objects inside frustum, so rays that all
+	  * lie inside it, such as the primary rays of one screen tile, skip the rest
+	  * of the tree. Starting at the root, nodes are replaced by their children
+	  * when that drops a child outside the frustum, or while there are fewer than
+	  * max_cull_entries subtrees. Nodes wholly inside the frustum are kept.
+	  * The subtrees are sorted near to far from the frustum origin, so the rays
+	  * find their closest hits early and skip the boxes behind them.
+	  * @param entries Set to the root nodes of the subtrees, for the traversal
+	  *        overloads taking entries. Empty if nothing is inside the frustum.
+	  */
+	inline void cull(const Frustum& frustum, std::vector<unsigned int>& entries) const {
+		entries.clear();
+		if (node_count == 0 || frustum.outside(node_data[0].bounds)) return;
+		entries.push_back(0);
+
+		//Open every entry one level per pass, so the limit is shared evenly
+		//rather than spent on the first subtree
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (unsigned int e=0; e<entries.size(); ) {
+				const BVHNode& node = node_data[entries[e]];
+				if (node.isLeaf() || frustum.contains(node.bounds)) {
+					++e;
+					continue;
+				}
+				const unsigned int left = entries[e]+1;
+				const unsigned int right = node.offset;
+				const bool left_visible = !frustum.outside(node_data[left].bounds);
+				const bool right_visible = !frustum.outside(node_data[right].bounds);
+				if (left_visible && right_visible) {
+					if (entries.size() < max_cull_entries) {
+						entries[e] = left;
+						entries.push_back(right);
+						changed = true;
+					}
+					++e;
+				}
+				else if (left_visible || right_visible) {
+					entries[e++] = left_visible ? left : right;
+					changed = true;
+				}
+				else {
+					entries[e] = entries.back();
+					entries.pop_back();
+					changed = true;
+				}
+			}
+		}
+
+		std::vector<std::pair<float, unsigned int> > order(entries.size());
+		for (unsigned int e=0; e<entries.size(); ++e) {
+			const AABB& box = node_data[entries[e]].bounds;
+			glm::vec3 d = glm::clamp(frustum.origin, box.min, box.max) - frustum.origin;
+			order[e] = std::make_pair(glm::dot(d, d), entries[e]);
+		}
+		std::sort(order.begin(), order.end());
+		for (unsigned int e=0; e<entries.size(); ++e) {
+			entries[e] = order[e].second;
+		}
+	}
+
+	/**
+	  * Counts the nodes whose bounds reach into frustum, which are the nodes
+	  * rays inside it may visit, to estimate how much of the tree they touch.
+	  * Stops counting once limit is passed.
+	  */
+	inline unsigned int countVisible(const Frustum& frustum, unsigned int limit) const {
+		if (node_count == 0) return 0;
+		unsigned int count = 0;
+		unsigned int stack[max_depth];
+		unsigned int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0 && count <= limit) {
+			const unsigned int index = stack[--stack_size];
+			const BVHNode& node = node_data[index];
+			if (frustum.outside(node.bounds)) continue;
+			count++;
+			if (!node.isLeaf()) {
+				stack[stack_size++] = node.offset;
+				stack[stack_size++] = index+1;
+			}
+		}
+		return count;
+	}
+
+	/**
+	  * Closest hit search through the subtrees found by cull(), with the same
+	  * contract as intersect(). The ray must lie inside the culled frustum.
+	  */
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, SceneObject*& hit,
+		const unsigned int* entries, unsigned int entry_count) const {
+		unsigned int index;
+		if (!intersect(ray, t_near, t_min, index, entries, entry_count, ObjectPrimitives(objects))) return false;
+		hit = objects[index];
+		return true;
+	}
+
+	template <class Primitives>
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit,
+		const unsigned int* entries, unsigned int entry_count, const Primitives& primitives) const {
+		bool found = false;
+		for (unsigned int e=0; e<entry_count; ++e) {
+			if (intersectSubtree(entries[e], ray, t_near, t_min, hit, primitives)) found = true;
+		}
+		return found;
+	}
+
+	/**
+	  * Finds the closest intersection of every active ray of a packet, with the
+	  * same contract per ray as intersect(). The rays must be coherent, see
+	  * RayPacket::isCoherent(). Once a single ray is left in a subtree, it
+	  * walks the rest of that subtree on its own.
+	  * @return The rays that found a closer hit than their incoming t_min
+	  */
+	template <unsigned int Size>
+	inline unsigned int intersect(RayPacket<Size>& packet, float t_near) const {
+		return intersect(packet, t_near, ObjectPrimitives(objects));
+	}
+
+	template <unsigned int Size, class Primitives>
+	inline unsigned int intersect(RayPacket<Size>& packet, float t_near, const Primitives& primitives) const {
+		if (node_count == 0) return 0;
+		return intersectSubtree(0, packet, t_near, primitives);
+	}
+
+	/**
+	  * Packet traversal through the subtrees found by cull(), see the single
+	  * ray overload
+	  */
+	template <unsigned int Size>
+	inline unsigned int intersect(RayPacket<Size>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) const {
+		return intersect(packet, t_near, entries, entry_count, ObjectPrimitives(objects));
+	}
+
+	template <unsigned int Size, class Primitives>
+	inline unsigned int intersect(RayPacket<Size>& packet, float t_near,
+		const unsigned int* entries, unsigned int entry_count, const Primitives& primitives) const {
+		unsigned int found = 0;
+		for (unsigned int e=0; e<entry_count; ++e) {
+			found |= intersectSubtree(entries[e], packet, t_near, primitives);
+		}
+		return found;
+	}
+
+	/**
+	  * Any hit query for a tree built from boxes, see the intersect() overload
+	  * above for what primitives must provide
+	  */
+	template <class Primitives>
+	inline bool occluded(const Ray& ray, float t_near, float t_max, const Primitives& primitives) const {
+		if (node_count == 0) return false;
+
+		const glm::vec3 origin = ray.getOrigin();
+		const glm::vec3 inv_dir = ray.getInvDirection();
+
+		unsigned int stack[max_depth];
+		unsigned int stack_size = 0;
+		unsigned int current = 0;
+
+		while (true) {
+			const BVHNode& node = node_data[current];
+			if (node.bounds.intersect(origin, inv_dir, t_max)) {
+				if (node.isLeaf()) {
+					for (unsigned int i=node.offset; i<node.offset+node.count; ++i) {
+						float t = primitives.intersect(index_data[i], ray);
+						if (t > t_near && t < t_max) return true;
+					}
+				}
+				else {
+					stack[stack_size++] = node.offset;
+					current = current+1;
+					continue;
+				}
+			}
+			if (stack_size == 0) break;
+			current = stack[--stack_size];
+		}
+		return false;
+	}
+
+private:
+	/**
+	  * Packet closest hit search below node root
+	  */
+	template <unsigned int Size, class Primitives>
+	inline unsigned int intersectSubtree(unsigned int root, RayPacket<Size>& packet, float t_near, const Primitives& primitives) const {
+		const bool dir_is_neg[3] = { packet.inv_dir_x[0] < 0.0f, packet.inv_dir_y[0] < 0.0f, packet.inv_dir_z[0] < 0.0f };
+
+		unsigned int found = 0;
+		unsigned int stack[max_depth];
+		unsigned int stack_mask[max_depth];
+		unsigned int stack_size = 0;
+		unsigned int current = root;
+		unsigned int mask = packet.active;
+
+		while (true) {
+			const BVHNode& node = node_data[current];
+			mask = packet.intersect(node.bounds, mask);
+			if (mask != 0 && (mask & (mask-1)) == 0 && !node.isLeaf()) {
+				//The packet has split up, a lone ray is cheaper to trace by itself
+				unsigned int k = 0;
+				while (!(mask & (1u << k))) ++k;
+				if (intersectSubtree(current, packet.rays[k], t_near, packet.t_min[k], packet.hit[k], primitives)) {
+					found |= mask;
+				}
+			}
+			else if (mask != 0) {
+				if (node.isLeaf()) {
+					for (unsigned int i=node.offset; i<node.offset+node.count; ++i) {
+						for (unsigned int k=0; k<Size; ++k) {
+							if (!(mask & (1u << k))) continue;
+							float t = primitives.intersect(index_data[i], packet.rays[k]);
+							if (t > t_near && t <= packet.t_min[k]) {
+								packet.t_min[k] = t;
+								packet.hit[k] = index_data[i];
+								found |= 1u << k;
+							}
+						}
+					}
+				}
+				else {
+					if (dir_is_neg[node.axis]) {
+						stack_mask[stack_size] = mask;
+						stack[stack_size++] = current+1;
+						current = node.offset;
+					}
+					else {
+						stack_mask[stack_size] = mask;
+						stack[stack_size++] = node.offset;
+						current = current+1;
+					}
+					continue;
+				}
+			}
+			if (stack_size == 0) break;
+			--stack_size;
+			current = stack[stack_size];
+			mask = stack_mask[stack_size];
+		}
+		return found;
+	}
+
+	/**
+	  * Single ray closest hit search below node root
+	  */
+	template <class Primitives>
+	inline bool intersectSubtree(unsigned int root, const Ray& ray, float t_near, float& t_min, unsigned int& hit, const Primitives& primitives) const {
+		const glm::vec3 origin = ray.getOrigin();
+		const glm::vec3 inv_dir = ray.getInvDirection();
+		const unsigned int signs = ray.getSigns();
+
+		bool found = false;
+		unsigned int stack[max_depth];
+		unsigned int stack_size = 0;
+		unsigned int current = root;
+
+		while (true) {
+			const BVHNode& node = node_data[current];
+			if (node.bounds.intersect(origin, inv_dir, t_min)) {
+				if (node.isLeaf()) {
+					for (unsigned int i=node.offset; i<node.offset+node.count; ++i) {
+						float t = primitives.intersect(index_data[i], ray);
+						if (t > t_near && t <= t_min) {
+							t_min = t;
+							hit = index_data[i];
+							found = true;
+						}
+					}
+				}
+				else {
+					//Visit the child on the near side of the split first, so t_min
+					//shrinks as early as possible and culls more of the far child
+					if (signs & (1u << node.axis)) {
+						stack[stack_size++] = current+1;
+						current = node.offset;
+					}
+					else {
+						stack[stack_size++] = node.offset;
+						current = current+1;
+					}
+					continue;
+				}
+			}
+			if (stack_size == 0) break;
+			current = stack[--stack_size];
+		}
+		return found;
+	}
+
+	/**
+	  * Lets the traversal templates intersect scene objects
+	  */
+	struct ObjectPrimitives {
+		ObjectPrimitives(const std::vector<SceneObject*>& objects) : objects(objects) {}
+		inline float intersect(unsigned int index, const Ray& ray) const { return objects[index]->intersect(ray); }
+		const std::vector<SceneObject*>& objects;
+	};
+	struct BuildEntry {
+		AABB bounds;
+		glm::vec3 centroid;
+		unsigned int index;
+	};
+
+	struct Bin {
+		AABB bounds;
+		unsigned int count;
+		Bin() : count(0) {}
+	};
+
+	static const unsigned int bin_count = 16;
+	static const unsigned int max_leaf_size = 4;
+
+	/**
+	  * Cost of one traversal step relative to one primitive intersection test
+	  */
+	static float traversalCost() { return 0.125f; }
+
+	/**
+	  * The best split plane between object bins found by a SAH sweep
+	  */
+	struct ObjectSplit {
+		float cost;         //< Surface area weighted primitive counts of the two sides
+		unsigned int bin;   //< Last bin on the left side, bin_count if no split was found
+		int axis;
+		float axis_min;
+		float scale;
+		AABB left_bounds;
+		AABB right_bounds;
+	};
+
+	/**
+	  * The best split of a node by a plane through space, with the objects that
+	  * cross the plane clipped and referenced on both sides
+	  */
+	struct SpatialSplit {
+		float cost;
+		unsigned int bin;   //< Last bin on the left side, bin_count if no split was found
+		int axis;
+		float position;     //< Where the plane is on axis
+		unsigned int left_count;
+		unsigned int right_count;
+		AABB left_bounds;
+		AABB right_bounds;
+	};
+
+	/**
+	  * Bins the centroids of count entries along the largest axis of centroid_bounds,
+	  * and sweeps the bins to find the split plane with the lowest SAH cost
+	  */
+	static ObjectSplit findObjectSplit(const BuildEntry* entries, unsigned int count, const AABB& centroid_bounds) {
+		ObjectSplit split;
+		split.cost = std::numeric_limits<float>::max();
+		split.bin = bin_count;
+		split.axis = centroid_bounds.largestAxis();
+		split.axis_min = centroid_bounds.min[split.axis];
+		float extent = centroid_bounds.max[split.axis] - split.axis_min;
+		if (extent <= 0.0f) {
+			split.scale = 0.0f;
+			return split;
+		}
+		split.scale = bin_count/extent;
+
+		Bin bins[bin_count];
+		for (unsigned int i=0; i<count; ++i) {
+			unsigned int b = binIndex(entries[i].centroid[split.axis], split.axis_min, split.scale);
+			bins[b].count++;
+			bins[b].bounds.extend(entries[i].bounds);
+		}
+
+		AABB right_boxes[bin_count];
+		unsigned int right_count[bin_count];
+		AABB right_box;
+		unsigned int right_sum = 0;
+		for (unsigned int b=bin_count-1; b>0; --b) {
+			right_box.extend(bins[b].bounds);
+			right_sum += bins[b].count;
+			right_boxes[b] = right_box;
+			right_count[b] = right_sum;
+		}
+
+		AABB left_box;
+		unsigned int left_sum = 0;
+		for (unsigned int b=0; b<bin_count-1; ++b) {
+			left_box.extend(bins[b].bounds);
+			left_sum += bins[b].count;
+			float cost = left_box.surfaceArea()*left_sum + right_boxes[b+1].surfaceArea()*right_count[b+1];
+			if (left_sum > 0 && right_count[b+1] > 0 && cost < split.cost) {
+				split.cost = cost;
+				split.bin = b;
+				split.left_bounds = left_box;
+				split.right_bounds = right_boxes[b+1];
+			}
+		}
+		return split;
+	}
+
+	unsigned int buildRecursive(std::vector<BuildEntry>& entries, unsigned int begin, unsigned int end, unsigned int depth) {
+		unsigned int node_index = static_cast<unsigned int>(nodes.size());
+		nodes.push_back(BVHNode());
+
+		AABB bounds, centroid_bounds;
+		for (unsigned int i=begin; i<end; ++i) {
+			bounds.extend(entries[i].bounds);
+			centroid_bounds.extend(entries[i].centroid);
+		}
+		nodes[node_index].bounds = bounds;
+
+		unsigned int count = end-begin;
+		if (count == 1 || depth >= max_depth-2) {
+			makeLeaf(node_index, begin, count);
+			return node_index;
+		}
+
+		//Bin the centroids along the largest axis, and pick the split plane with
+		//the lowest surface area heuristic cost. If all centroids coincide no plane
+		//can separate them, so split by count unless the primitives fit in one leaf.
+		ObjectSplit split = findObjectSplit(&entries[0]+begin, count, centroid_bounds);
+		const int axis = split.axis;
+		unsigned int mid = begin;
+
+		float leaf_cost = static_cast<float>(count);
+		float split_cost = traversalCost() + split.cost/bounds.surfaceArea();
+		if (count <= max_leaf_size && (split.bin == bin_count || leaf_cost <= split_cost)) {
+			makeLeaf(node_index, begin, count);
+			return node_index;
+		}
+
+		if (split.bin < bin_count) {
+			const float axis_min = split.axis_min;
+			const float scale = split.scale;
+			const unsigned int best_split = split.bin;
+			BuildEntry* middle = std::partition(&entries[0]+begin, &entries[0]+end,
+				[=](const BuildEntry& e) { return binIndex(e.centroid[axis], axis_min, scale) <= best_split; });
+			mid = static_cast<unsigned int>(middle - &entries[0]);
+		}
+
+		if (mid == begin || mid == end) {
+			mid = begin + count/2;
+			std::nth_element(&entries[0]+begin, &entries[0]+mid, &entries[0]+end,
+				[=](const BuildEntry& a, const BuildEntry& b) { return a.centroid[axis] < b.centroid[axis]; });
+		}
+
+		nodes[node_index].axis = static_cast<unsigned short>(axis);
+		nodes[node_index].count = 0;
+		buildRecursive(entries, begin, mid, depth+1);
+		unsigned int right = buildRecursive(entries, mid, end, depth+1);
+		nodes[node_index].offset = right;
+		return node_index;
+	}
+
+	/**
+	  * Builds the subtree over refs for the spatial split build. Unlike
+	  * buildRecursive, a node may hand the same object to both children, so the
+	  * references are moved into new lists for each child, and leaves append
+	  * their objects to indices as they are made.
+	  * @param min_overlap Spatial splits are only tried when the children of the
+	  *                    best object split overlap by more than this area
+	  * @param budget How many more references spatial splits may create
+	  */
+	unsigned int buildSpatialRecursive(std::vector<BuildEntry>& refs, unsigned int depth, float min_overlap, unsigned int& budget) {
+		unsigned int node_index = static_cast<unsigned int>(nodes.size());
+		nodes.push_back(BVHNode());
+
+		AABB bounds, centroid_bounds;
+		for (unsigned int i=0; i<refs.size(); ++i) {
+			bounds.extend(refs[i].bounds);
+			centroid_bounds.extend(refs[i].centroid);
+		}
+		nodes[node_index].bounds = bounds;
+
+		const unsigned int count = static_cast<unsigned int>(refs.size());
+		if (count == 1 || depth >= max_depth-2) {
+			makeSpatialLeaf(node_index, refs);
+			return node_index;
+		}
+
+		ObjectSplit object_split = findObjectSplit(&refs[0], count, centroid_bounds);
+		SpatialSplit spatial_split;
+		spatial_split.bin = bin_count;
+		spatial_split.cost = std::numeric_limits<float>::max();
+		if (object_split.bin == bin_count ||
+			object_split.left_bounds.intersection(object_split.right_bounds).surfaceArea() > min_overlap) {
+			spatial_split = findSpatialSplit(refs, bounds);
+			if (spatial_split.bin < bin_count && spatial_split.left_count+spatial_split.right_count-count > budget) {
+				spatial_split.bin = bin_count;
+			}
+		}
+
+		bool use_spatial = spatial_split.bin < bin_count && spatial_split.cost < object_split.cost;
+		float best_cost = use_spatial ? spatial_split.cost : object_split.cost;
+		bool found = use_spatial || object_split.bin < bin_count;
+
+		float leaf_cost = static_cast<float>(count);
+		float split_cost = traversalCost() + best_cost/bounds.surfaceArea();
+		if (count <= max_leaf_size && (!found || leaf_cost <= split_cost)) {
+			makeSpatialLeaf(node_index, refs);
+			return node_index;
+		}
+
+		std::vector<BuildEntry> left, right;
+		int axis = object_split.axis;
+		if (use_spatial) {
+			axis = spatial_split.axis;
+			splitReferences(refs, spatial_split, left, right);
+			budget -= glm::min(budget, static_cast<unsigned int>(left.size()+right.size()) - count);
+		}
+		else if (object_split.bin < bin_count) {
+			for (unsigned int i=0; i<count; ++i) {
+				if (binIndex(refs[i].centroid[axis], object_split.axis_min, object_split.scale) <= object_split.bin) {
+					left.push_back(refs[i]);
+				}
+				else {
+					right.push_back(refs[i]);
+				}
+			}
+		}
+
+		if (left.empty() || right.empty()) {
+			unsigned int mid = count/2;
+			std::nth_element(refs.begin(), refs.begin()+mid, refs.end(),
+				[=](const BuildEntry& a, const BuildEntry& b) { return a.centroid[axis] < b.centroid[axis]; });
+			left.assign(refs.begin(), refs.begin()+mid);
+			right.assign(refs.begin()+mid, refs.end());
+		}
+		std::vector<BuildEntry>().swap(refs);
+
+		nodes[node_index].axis = static_cast<unsigned short>(axis);
+		nodes[node_index].count = 0;
+		buildSpatialRecursive(left, depth+1, min_overlap, budget);
+		std::vector<BuildEntry>().swap(left);
+		unsigned int right_index = buildSpatialRecursive(right, depth+1, min_overlap, budget);
+		nodes[node_index].offset = right_index;
+		return node_index;
+	}
+
+	/**
+	  * Cuts the node into equal bins along its largest axis, clips every
+	  * reference to each bin it touches, and sweeps the bins for the plane with the
+	  * lowest SAH cost. A reference counts on the left of each plane after the bin
+	  * it starts in, and on the right of each plane before the bin it ends in.
+	  */
+	SpatialSplit findSpatialSplit(const std::vector<BuildEntry>& refs, const AABB& bounds) {
+		SpatialSplit split;
+		split.cost = std::numeric_limits<float>::max();
+		split.bin = bin_count;
+		split.axis = bounds.largestAxis();
+		const int axis = split.axis;
+		const float axis_min = bounds.min[axis];
+		const float extent = bounds.max[axis] - axis_min;
+		if (extent <= 0.0f) return split;
+		const float width = extent/bin_count;
+		const float scale = bin_count/extent;
+
+		AABB bin_bounds[bin_count];
+		unsigned int enter[bin_count] = { 0 };
+		unsigned int exit[bin_count] = { 0 };
+		for (unsigned int i=0; i<refs.size(); ++i) {
+			unsigned int first = binIndex(refs[i].bounds.min[axis], axis_min, scale);
+			unsigned int last = binIndex(refs[i].bounds.max[axis], axis_min, scale);
+			enter[first]++;
+			exit[last]++;
+			if (first == last) {
+				bin_bounds[first].extend(refs[i].bounds);
+				continue;
+			}
+			for (unsigned int b=first; b<=last; ++b) {
+				AABB slab = refs[i].bounds;
+				slab.min[axis] = glm::max(slab.min[axis], axis_min + b*width);
+				slab.max[axis] = glm::min(slab.max[axis], (b == bin_count-1) ? bounds.max[axis] : axis_min + (b+1)*width);
+				AABB clipped = objects[refs[i].index]->getClippedBoundingBox(slab);
+				if (!clipped.isEmpty()) bin_bounds[b].extend(clipped);
+			}
+		}
+
+		AABB right_boxes[bin_count];
+		unsigned int right_count[bin_count];
+		AABB right_box;
+		unsigned int right_sum = 0;
+		for (unsigned int b=bin_count-1; b>0; --b) {
+			right_box.extend(bin_bounds[b]);
+			right_sum += exit[b];
+			right_boxes[b] = right_box;
+			right_count[b] = right_sum;
+		}
+
+		AABB left_box;
+		unsigned int left_sum = 0;
+		for (unsigned int b=0; b<bin_count-1; ++b) {
+			left_box.extend(bin_bounds[b]);
+			left_sum += enter[b];
+			float cost = left_box.surfaceArea()*left_sum + right_boxes[b+1].surfaceArea()*right_count[b+1];
+			if (left_sum > 0 && right_count[b+1] > 0 && cost < split.cost) {
+				split.cost = cost;
+				split.bin = b;
+				split.left_count = left_sum;
+				split.right_count = right_count[b+1];
+				split.left_bounds = left_box;
+				split.right_bounds = right_boxes[b+1];
+			}
+		}
+		split.position = axis_min + (split.bin+1)*width;
+		return split;
+	}
+
+	/**
+	  * Sorts refs to the sides of a spatial split. A reference that crosses the
+	  * plane is clipped into two, unless putting all of it on one side is
+	  * cheaper by the SAH than referencing it twice (Stich's reference unsplitting).
+	  */
+	void splitReferences(const std::vector<BuildEntry>& refs, const SpatialSplit& split,
+		std::vector<BuildEntry>& left, std::vector<BuildEntry>& right) {
+		const int axis = split.axis;
+		const float left_area = split.left_bounds.surfaceArea();
+		const float right_area = split.right_bounds.surfaceArea();
+		const float n_left = static_cast<float>(split.left_count);
+		const float n_right = static_cast<float>(split.right_count);
+		const float split_cost = left_area*n_left + right_area*n_right;
+
+		for (unsigned int i=0; i<refs.size(); ++i) {
+			const BuildEntry& ref = refs[i];
+			if (ref.bounds.max[axis] <= split.position) {
+				left.push_back(ref);
+				continue;
+			}
+			if (ref.bounds.min[axis] >= split.position) {
+				right.push_back(ref);
+				continue;
+			}
+
+			AABB left_union = split.left_bounds;
+			left_union.extend(ref.bounds);
+			AABB right_union = split.right_bounds;
+			right_union.extend(ref.bounds);
+			float all_left_cost = left_union.surfaceArea()*n_left + right_area*(n_right-1.0f);
+			float all_right_cost = left_area*(n_left-1.0f) + right_union.surfaceArea()*n_right;
+
+			if (all_left_cost < split_cost && all_left_cost <= all_right_cost) {
+				left.push_back(ref);
+			}
+			else if (all_right_cost < split_cost) {
+				right.push_back(ref);
+			}
+			else {
+				SceneObject* object = objects[ref.index];
+				AABB left_slab = ref.bounds;
+				left_slab.max[axis] = split.position;
+				AABB right_slab = ref.bounds;
+				right_slab.min[axis] = split.position;
+
+				BuildEntry left_part = ref;
+				left_part.bounds = object->getClippedBoundingBox(left_slab);
+				left_part.centroid = left_part.bounds.centroid();
+				BuildEntry right_part = ref;
+				right_part.bounds = object->getClippedBoundingBox(right_slab);
+				right_part.centroid = right_part.bounds.centroid();
+
+				//Clipping can leave nothing on one side when the object only
+				//touches the plane, and then the reference is not duplicated
+				if (left_part.bounds.isEmpty() && right_part.bounds.isEmpty()) {
+					left.push_back(ref);
+					continue;
+				}
+				if (!left_part.bounds.isEmpty()) left.push_back(left_part);
+				if (!right_part.bounds.isEmpty()) right.push_back(right_part);
+			}
+		}
+	}
+
+	void makeSpatialLeaf(unsigned int node_index, const std::vector<BuildEntry>& refs) {
+		makeLeaf(node_index, static_cast<unsigned int>(indices.size()), static_cast<unsigned int>(refs.size()));
+		for (unsigned int i=0; i<refs.size(); ++i) {
+			indices.push_back(refs[i].index);
+		}
+	}
+
+	inline void makeLeaf(unsigned int node_index, unsigned int first, unsigned int count) {
+		nodes[node_index].offset = first;
+		nodes[node_index].count = static_cast<unsigned short>(count);
+		nodes[node_index].axis = 0;
+	}
+
+	/**
+	  * Spreads the 10 low bits of v out so there are two zero bits between each
+	  */
+	static inline unsigned int expandBits(unsigned int v) {
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	/**
+	  * 30 bit Morton code for a point in the unit cube, x in the highest bit of each triple
+	  */
+	static inline unsigned int mortonCode(const glm::vec3& p) {
+		unsigned int x = static_cast<unsigned int>(glm::clamp(p.x*1024.0f, 0.0f, 1023.0f));
+		unsigned int y = static_cast<unsigned int>(glm::clamp(p.y*1024.0f, 0.0f, 1023.0f));
+		unsigned int z = static_cast<unsigned int>(glm::clamp(p.z*1024.0f, 0.0f, 1023.0f));
+		return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+	}
+
+	/**
+	  * Index of the highest set bit in v, which must be non-zero
+	  */
+	static inline int highestBit(unsigned int v) {
+		int bit = 0;
+		while (v >>= 1) bit++;
+		return bit;
+	}
+
+	static inline int leadingZeros(unsigned int v) {
+		return (v == 0) ? 32 : 31-highestBit(v);
+	}
+
+	/**
+	  * Length of the common prefix of the codes at i and j, or -1 if j is outside
+	  * the array. Equal codes are told apart by their index.
+	  */
+	static inline int prefixLength(const std::vector<unsigned int>& codes, int i, int j) {
+		if (j < 0 || j >= static_cast<int>(codes.size())) return -1;
+		if (codes[i] == codes[j]) return 32 + leadingZeros(static_cast<unsigned int>(i ^ j));
+		return leadingZeros(codes[i] ^ codes[j]);
+	}
+
+	static inline unsigned int binIndex(float value, float axis_min, float scale) {
+		unsigned int b = static_cast<unsigned int>((value-axis_min)*scale);
+		return (b < bin_count) ? b : bin_count-1;
+	}
+
+	BVH(const BVH&);
+	BVH& operator=(const BVH&);
+
+	void setObjects(const std::vector<std::shared_ptr<SceneObject> >& input) {
+		objects.resize(input.size());
+		for (unsigned int i=0; i<input.size(); ++i) {
+			objects[i] = input[i].get();
+		}
+	}
+
+	/**
+	  * Points the traversal arrays at the vectors owned by this tree
+	  */
+	void useOwnedStorage() {
+		node_data = nodes.empty() ? NULL : &nodes[0];
+		node_count = static_cast<unsigned int>(nodes.size());
+		index_data = indices.empty() ? NULL : &indices[0];
+		index_count = static_cast<unsigned int>(indices.size());
+	}
+
+	//Storage for trees built in memory
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> indices;
+
+	//What traversal reads: either the vectors above or a mapped cache file
+	const BVHNode* node_data;
+	unsigned int node_count;
+	const unsigned int* index_data;
+	unsigned int index_count;
+	std::shared_ptr<MappedFile> mapping;
+
+	//The objects in build order. Leaves refer to them through index_data.
+	std::vector<SceneObject*> objects;
+};
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef _BVHCACHE_HPP__
+#define _BVHCACHE_HPP__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "BVH.hpp"
+#include "WideBVH.hpp"
+#include "MappedFile.hpp"
+#include "SceneObject.hpp"
+
+/**
+  * Stores built acceleration structures on disk so later runs over the same
+  * scene can skip the build. The file holds the binary tree and optionally
+  * one wide layout, as flat arrays that only use indices, so a loaded file is
+  * used straight from the memory mapping with no parsing or pointer fix-ups.
+  *
+  * A BVH only depends on the bounding boxes of the objects, in order, and on
+  * the build settings, so that is what the scene hash is computed from. With
+  * spatial splits the node bounds also depend on the shapes the boxes are
+  * clipped to, such as which diagonal of its box a triangle lies on, so for
+  * that build mode the clip shapes of the objects are hashed too. The file
+  * name is made from the hash, and the hash is stored in the file too.
+  *
+  * Layout: BVHCacheHeader, then the arrays at the offsets in the header, each
+  * aligned to a cache line. Numbers are stored in the byte order of the machine
+  * that wrote them, the header records the struct sizes so a file written by a
+  * different build is rejected rather than misread. Before a file is used, the
+  * arrays are checked to lie inside it and the trees to only refer to nodes,
+  * leaves and objects that exist, so a truncated or corrupt file is rejected too.
+  */
+struct BVHCacheHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int node_size;
+	unsigned int wide_node_size;
+	unsigned int wide_width;
+	unsigned long long scene_hash;
+	unsigned int object_count;
+	unsigned int index_count;
+	unsigned int node_count;
+	unsigned int wide_node_count;
+	unsigned int wide_leaf_count;
+	unsigned long long node_offset;
+	unsigned long long index_offset;
+	unsigned long long wide_node_offset;
+	unsigned long long wide_leaf_offset;
+	unsigned long long file_size;
+};
+
+class BVHCache {
+public:
+	/**
+	  * Hashes the object bounding boxes and build mode with 64 bit FNV-1a, and
+	  * the clip shapes of the objects for spatial split builds
+	  */
+	static unsigned long long hashScene(const std::vector<std::shared_ptr<SceneObject> >& objects, bvh::BuildMode mode) {
+		unsigned long long hash = 14695981039346656037ull;
+		unsigned int header[3] = { version, static_cast<unsigned int>(mode), static_cast<unsigned int>(objects.size()) };
+		hash = fnv1a(hash, header, sizeof(header));
+		for (unsigned int i=0; i<objects.size(); ++i) {
+			AABB box = objects[i]->getBoundingBox();
+			float values[6] = { box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z };
+			hash = fnv1a(hash, values, sizeof(values));
+			if (mode == bvh::BuildSpatialSplits) {
+				float shape[SceneObject::max_clip_shape_values];
+				unsigned int count = objects[i]->getClipShape(shape);
+				hash = fnv1a(hash, &count, sizeof(count));
+				hash = fnv1a(hash, shape, count*sizeof(float));
+			}
+		}
+		return hash;
+	}
+
+	/**
+	  * Returns the name of the cache file for a scene hash in directory
+	  */
+	static std::string filename(const std::string& directory, unsigned long long hash) {
+		std::stringstream name;
+		name << directory;
+		if (!directory.empty() && directory[directory.size()-1] != '/' && directory[directory.size()-1] != '\\') {
+			name << "/";
+		}
+		name << "bvh_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".cache";
+		return name.str();
+	}
+
+	/**
+	  * Maps the cache file and attaches the trees to it. The wide tree of the
+	  * given width is only attached if the file has that layout, otherwise it
+	  * is left empty for the caller to collapse.
+	  * @return false if there is no valid cache file for this scene
+	  */
+	static bool load(const std::string& file, unsigned long long hash,
+		const std::vector<std::shared_ptr<SceneObject> >& objects, unsigned int width,
+		BVH& bvh, WideBVH<4>& bvh4, WideBVH<8>& bvh8) {
+		struct stat buffer;
+		if (stat(file.c_str(), &buffer) != 0) return false;
+
+		std::shared_ptr<MappedFile> mapped;
+		try {
+			mapped.reset(new MappedFile(file));
+		}
+		catch (std::runtime_error&) {
+			return false;
+		}
+
+		const char* data = mapped->getData();
+		if (mapped->getSize() < sizeof(BVHCacheHeader)) return false;
+		const BVHCacheHeader& header = *reinterpret_cast<const BVHCacheHeader*>(data);
+
+		if (std::memcmp(header.magic, magic(), sizeof(header.magic)) != 0
+			|| header.version != version
+			|| header.node_size != sizeof(BVHNode)
+			|| header.scene_hash != hash
+			|| header.object_count != objects.size()
+			|| header.file_size != mapped->getSize()
+			|| !validate(header, data)) {
+			return false;
+		}
+
+		bvh.attach(objects,
+			reinterpret_cast<const BVHNode*>(data+header.node_offset), header.node_count,
+			reinterpret_cast<const unsigned int*>(data+header.index_offset), header.index_count, mapped);
+
+		bvh4.clear();
+		bvh8.clear();
+		if (header.wide_width == 4 && width == 4 && header.wide_node_size == sizeof(WideBVHNode<4>)
+			&& validateWide<4>(header, data)) {
+			attachWide(bvh4, bvh, header, data, mapped);
+		}
+		else if (header.wide_width == 8 && width == 8 && header.wide_node_size == sizeof(WideBVHNode<8>)
+			&& validateWide<8>(header, data)) {
+			attachWide(bvh8, bvh, header, data, mapped);
+		}
+		return true;
+	}
+
+	/**
+	  * Writes the trees to file. The file is written under a temporary name and
+	  * renamed into place, so a process starting at the same time never maps a
+	  * half written file. Failing to write the cache is not an error.
+	  */
+	static void save(const std::string& file, unsigned long long hash, unsigned int width,
+		const BVH& bvh, const WideBVH<4>& bvh4, const WideBVH<8>& bvh8) {
+		BVHCacheHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, magic(), sizeof(header.magic));
+		header.version = version;
+		header.node_size = sizeof(BVHNode);
+		header.scene_hash = hash;
+		header.object_count = bvh.getObjectCount();
+		header.index_count = bvh.getIndexCount();
+		header.node_count = bvh.getNodeCount();
+
+		unsigned long long offset = align(sizeof(BVHCacheHeader));
+		header.node_offset = offset;
+		offset = align(offset + sizeof(BVHNode)*header.node_count);
+		header.index_offset = offset;
+		offset = align(offset + sizeof(unsigned int)*header.index_count);
+
+		const char* wide_nodes = NULL;
+		const char* wide_leaves = NULL;
+		if (width == 4 && !bvh4.empty()) {
+			describeWide(bvh4, header, wide_nodes, wide_leaves);
+		}
+		else if (width == 8 && !bvh8.empty()) {
+			describeWide(bvh8, header, wide_nodes, wide_leaves);
+		}
+		header.wide_node_offset = offset;
+		offset = align(offset + header.wide_node_size*header.wide_node_count);
+		header.wide_leaf_offset = offset;
+		offset += sizeof(WideBVHLeaf)*header.wide_leaf_count;
+		header.file_size = offset;
+
+		std::string temp_file = file + ".tmp";
+		{
+			std::ofstream out(temp_file.c_str(), std::ios::binary | std::ios::trunc);
+			if (!out) return;
+			write(out, &header, sizeof(header), header.node_offset);
+			write(out, bvh.getNodeData(), sizeof(BVHNode)*header.node_count, header.index_offset);
+			write(out, bvh.getIndexData(), sizeof(unsigned int)*header.index_count, header.wide_node_offset);
+			write(out, wide_nodes, header.wide_node_size*header.wide_node_count, header.wide_leaf_offset);
+			write(out, wide_leaves, sizeof(WideBVHLeaf)*header.wide_leaf_count, header.file_size);
+			if (!out) {
+				out.close();
+				std::remove(temp_file.c_str());
+				return;
+			}
+		}
+		std::remove(file.c_str());
+		if (std::rename(temp_file.c_str(), file.c_str()) != 0) {
+			std::remove(temp_file.c_str());
+		}
+	}
+
+private:
+	static const unsigned int version = 3;
+
+	static const char* magic() { return "RTBVHC\0\0"; }
+
+	static unsigned long long align(unsigned long long offset) {
+		return (offset + 63) & ~63ull;
+	}
+
+	static unsigned long long fnv1a(unsigned long long hash, const void* data, size_t size) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i=0; i<size; ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	/**
+	  * Writes size bytes and pads with zeros up to the offset of the next array
+	  */
+	static void write(std::ofstream& out, const void* data, size_t size, unsigned long long next_offset) {
+		if (size > 0) out.write(static_cast<const char*>(data), size);
+		while (static_cast<unsigned long long>(out.tellp()) < next_offset) out.put(0);
+	}
+
+	/**
+	  * Checks that count elements of size bytes at offset lie inside the file,
+	  * at a cache line aligned offset as save() writes them
+	  */
+	static bool inFile(const BVHCacheHeader& header, unsigned long long offset, unsigned long long count, unsigned long long size) {
+		return offset % 64 == 0 && offset <= header.file_size && count <= (header.file_size - offset)/size;
+	}
+
+	/**
+	  * Checks the binary tree and the index array of a file: the arrays lie
+	  * inside the file, the indices refer to objects, leaves to runs of the
+	  * index array, and children to nodes after their parent, no deeper than
+	  * the traversal stack
+	  */
+	static bool validate(const BVHCacheHeader& header, const char* data) {
+		if (!inFile(header, header.node_offset, header.node_count, sizeof(BVHNode))
+			|| !inFile(header, header.index_offset, header.index_count, sizeof(unsigned int))) {
+			return false;
+		}
+
+		const unsigned int* indices = reinterpret_cast<const unsigned int*>(data+header.index_offset);
+		for (unsigned int i=0; i<header.index_count; ++i) {
+			if (indices[i] >= header.object_count) return false;
+		}
+
+		const BVHNode* nodes = reinterpret_cast<const BVHNode*>(data+header.node_offset);
+		std::vector<unsigned int> depth(header.node_count, 0);
+		for (unsigned int i=0; i<header.node_count; ++i) {
+			if (depth[i] >= BVH::max_depth) return false;
+			if (nodes[i].isLeaf()) {
+				if (static_cast<unsigned long long>(nodes[i].offset) + nodes[i].count > header.index_count) return false;
+				continue;
+			}
+			const unsigned int right = nodes[i].offset;
+			if (i+1 >= header.node_count || right <= i+1 || right >= header.node_count) return false;
+			depth[i+1] = std::max(depth[i+1], depth[i]+1);
+			depth[right] = std::max(depth[right], depth[i]+1);
+		}
+		return true;
+	}
+
+	/**
+	  * Checks the wide tree of a file in the same way as validate()
+	  */
+	template <unsigned int Width>
+	static bool validateWide(const BVHCacheHeader& header, const char* data) {
+		if (!inFile(header, header.wide_node_offset, header.wide_node_count, sizeof(WideBVHNode<Width>))
+			|| !inFile(header, header.wide_leaf_offset, header.wide_leaf_count, sizeof(WideBVHLeaf))) {
+			return false;
+		}
+
+		const WideBVHLeaf* leaves = reinterpret_cast<const WideBVHLeaf*>(data+header.wide_leaf_offset);
+		for (unsigned int i=0; i<header.wide_leaf_count; ++i) {
+			if (static_cast<unsigned long long>(leaves[i].offset) + leaves[i].count > header.index_count) return false;
+		}
+
+		const WideBVHNode<Width>* nodes = reinterpret_cast<const WideBVHNode<Width>*>(data+header.wide_node_offset);
+		std::vector<unsigned int> depth(header.wide_node_count, 0);
+		for (unsigned int i=0; i<header.wide_node_count; ++i) {
+			if (depth[i] >= BVH::max_depth || nodes[i].valid_mask >= (1u << Width)) return false;
+			for (unsigned int c=0; c<Width; ++c) {
+				if (!(nodes[i].valid_mask & (1u << c))) continue;
+				const unsigned int child = nodes[i].child[c];
+				if (child & WideBVHNode<Width>::leaf_flag) {
+					if ((child & ~WideBVHNode<Width>::leaf_flag) >= header.wide_leaf_count) return false;
+				}
+				else {
+					if (child <= i || child >= header.wide_node_count) return false;
+					depth[child] = std::max(depth[child], depth[i]+1);
+				}
+			}
+		}
+		return true;
+	}
+
+	template <unsigned int Width>
+	static void describeWide(const WideBVH<Width>& wide, BVHCacheHeader& header, const char*& nodes, const char*& leaves) {
+		header.wide_width = Width;
+		header.wide_node_size = sizeof(WideBVHNode<Width>);
+		header.wide_node_count = wide.getNodeCount();
+		header.wide_leaf_count = wide.getLeafCount();
+		nodes = reinterpret_cast<const char*>(wide.getNodeData());
+		leaves = reinterpret_cast<const char*>(wide.getLeafData());
+	}
+
+	template <unsigned int Width>
+	static void attachWide(WideBVH<Width>& wide, const BVH& bvh, const BVHCacheHeader& header,
+		const char* data, std::shared_ptr<MappedFile> mapped) {
+		wide.attach(bvh,
+			reinterpret_cast<const WideBVHNode<Width>*>(data+header.wide_node_offset), header.wide_node_count,
+			reinterpret_cast<const WideBVHLeaf*>(data+header.wide_leaf_offset), header.wide_leaf_count, mapped);
+	}
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _CACHE_HPP__
+#define _CACHE_HPP__
+
+#include <vector>
+#include <cstddef>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace cache {
+	/**
+	  * Size assumed for the L2 cache when the OS does not tell
+	  */
+	static const std::size_t default_l2_size = 256*1024;
+
+	/**
+	  * Returns the size in bytes of the L2 cache of one core
+	  */
+	inline std::size_t l2Size() {
+		std::size_t size = 0;
+#if defined(_WIN32)
+		DWORD length = 0;
+		GetLogicalProcessorInformation(NULL, &length);
+		std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length/sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		if (!info.empty() && GetLogicalProcessorInformation(&info[0], &length)) {
+			for (std::size_t k=0; k<info.size(); ++k) {
+				if (info[k].Relationship == RelationCache && info[k].Cache.Level == 2) {
+					size = info[k].Cache.Size;
+					break;
+				}
+			}
+		}
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+		long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		if (bytes > 0) size = static_cast<std::size_t>(bytes);
+#endif
+		return (size > 0) ? size : default_l2_size;
+	}
+}
+
+/**
+  * Counts the L2 cache accesses and misses of the thread that opened it, from
+  * the hardware performance counters. There is no portable event for the L2
+  * itself, so the accesses are counted as the L1 data cache read misses, and
+  * the misses as the references to the last level cache, which on CPUs with
+  * an L3 are the requests that missed the L2. The last level references also
+  * count prefetches and instruction fetches, so the miss rate is an estimate,
+  * but one that compares well between runs on the same machine.
+  *
+  * Only available on Linux, and only when the kernel allows user programs to
+  * count their own threads (perf_event_paranoid 2 or lower, and not in most
+  * virtual machines).
+  */
+class CacheCounters {
+public:
+	CacheCounters() : accesses_fd(-1), misses_fd(-1) {}
+
+	~CacheCounters() {
+		close();
+	}
+
+	/**
+	  * Sets up counting for the calling thread, stopped
+	  * @return false if the counters are not available
+	  */
+	bool open() {
+		close();
+#if defined(__linux__)
+		accesses_fd = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+		misses_fd = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+		if (accesses_fd < 0 || misses_fd < 0) close();
+#endif
+		return isOpen();
+	}
+
+	inline bool isOpen() const { return accesses_fd >= 0; }
+
+	/**
+	  * Sets the counts to zero and starts counting. Can be called from any thread.
+	  */
+	void start() {
+#if defined(__linux__)
+		if (!isOpen()) return;
+		ioctl(accesses_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(accesses_fd, PERF_EVENT_IOC_ENABLE, 0);
+		ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	/**
+	  * Stops counting, so the counts can be read. Can be called from any thread.
+	  */
+	void stop() {
+#if defined(__linux__)
+		if (!isOpen()) return;
+		ioctl(accesses_fd, PERF_EVENT_IOC_DISABLE, 0);
+		ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	}
+
+	/**
+	  * Adds the counts since start() to accesses and misses
+	  * @return false if nothing could be read
+	  */
+	bool read(unsigned long long& accesses, unsigned long long& misses) const {
+#if defined(__linux__)
+		unsigned long long counts[2];
+		if (isOpen() && ::read(accesses_fd, &counts[0], sizeof(counts[0])) == sizeof(counts[0])
+			&& ::read(misses_fd, &counts[1], sizeof(counts[1])) == sizeof(counts[1])) {
+			accesses += counts[0];
+			misses += counts[1];
+			return true;
+		}
+#else
+		(void) accesses;
+		(void) misses;
+#endif
+		return false;
+	}
+
+private:
+	CacheCounters(const CacheCounters&);
+	CacheCounters& operator=(const CacheCounters&);
+
+	void close() {
+#if !defined(_WIN32)
+		if (accesses_fd >= 0) ::close(accesses_fd);
+		if (misses_fd >= 0) ::close(misses_fd);
+#endif
+		accesses_fd = -1;
+		misses_fd = -1;
+	}
+
+#if defined(__linux__)
+	static int openCounter(unsigned int type, unsigned long long config) {
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+#endif
+
+	int accesses_fd;
+	int misses_fd;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _CACHELINEARRAY_HPP__
+#define _CACHELINEARRAY_HPP__
+
+#include <cstddef>
+#include <memory>
+#include <new>
+
+/**
+  * A fixed size array that starts on a cache line boundary, for per thread
+  * data that must not share cache lines between threads. new[] only aligns
+  * to 8 or 16 bytes, so padding each element to a cache line is not enough
+  * on its own. T must be padded to a multiple of line_size bytes.
+  */
+template <class T>
+class CacheLineArray {
+public:
+	static const std::size_t line_size = 64;
+
+	explicit CacheLineArray(std::size_t count)
+		: count(count), storage(new char[count*sizeof(T) + line_size-1]) {
+		const std::size_t address = reinterpret_cast<std::size_t>(storage.get());
+		elements = reinterpret_cast<T*>((address + line_size-1) & ~(line_size-1));
+		for (std::size_t k=0; k<count; ++k) new (elements+k) T();
+	}
+
+	~CacheLineArray() {
+		for (std::size_t k=0; k<count; ++k) elements[k].~T();
+	}
+
+	inline std::size_t size() const { return count; }
+	inline T& operator[](std::size_t k) { return elements[k]; }
+	inline const T& operator[](std::size_t k) const { return elements[k]; }
+
+private:
+	CacheLineArray(const CacheLineArray&);
+	CacheLineArray& operator=(const CacheLineArray&);
+
+	std::size_t count;
+	std::unique_ptr<char[]> storage;
+	T* elements;
+};
+
+#endif
@@ -18,7 +18,7 @@ public:
 	ColorEffect(glm::vec3 color) : color(color){
 	}
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
 		return color;
 	}
 
@@ -4,6 +4,7 @@
 #include <string>
 #include <limits>
 #include <sstream>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 
@@ -11,6 +12,8 @@
 #include <IL/ilu.h>
 #include <boost/scoped_ptr.hpp>
 
+#include "Environment.hpp"
+
 namespace cubemap{
 	static const std::string SaintLazarusChurch = "cubemaps/SaintLazarusChurch3/";
 	static const std::string Desert = "cubemaps/Desert/";
@@ -21,7 +24,7 @@ namespace cubemap{
 	static const std::string Creek = "cubemaps/Creek/";
 }
 
-class CubeMap : public SceneObject {
+class CubeMap : public Environment {
 public:
 	CubeMap(std::string cubemap_path){
 		ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
@@ -35,9 +38,9 @@ public:
 	
 	/**
 	  * Ray-trace function that returns what texel you hit in the
-	  * cube map, since any ray will hit some point in the cube map
+	  * cube map, since any ray that misses the scene will hit some point in the cube map
 	  */
-	glm::vec3 rayTrace(Ray &ray, const float& t, RayTracerState& state) {
+	glm::vec3 rayTrace(const Ray& ray) {
 		glm::vec3 out_color(0.0f);
 		glm::vec3 dir =  ray.getDirection();
 		float x = dir.x;
@@ -81,15 +84,17 @@ public:
 		}
 		return out_color;
 	}
-	
+
 	/**
-	  * A ray will always hit the cube map by definition, but the point of intersection
-	  * is as far away as possible
+	  * The faces span from -1 to 1 on the planes at distance 1
 	  */
-	float intersect(const Ray& r) {
-		return std::numeric_limits<float>::max();
+	float getTexelDensity() const {
+		const texture* faces[6] = { &posx, &negx, &posy, &negy, &posz, &negz };
+		unsigned int size = 0;
+		for (int k=0; k<6; ++k) size = std::max(size, std::max(faces[k]->width, faces[k]->height));
+		return size/2.0f;
 	}
-
+	
 private:
 	struct texture {
 		std::vector<float> data;
@@ -0,0 +1,28 @@
+#ifndef _ENVIRONMENT_HPP__
+#define _ENVIRONMENT_HPP__
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+
+/**
+  * Abstract class for what surrounds the scene, such as the cube map. It is
+  * not a scene object: it is never intersected, and is only looked up for
+  * rays that leave the scene without hitting anything.
+  */
+class Environment {
+public:
+	/**
+	  * Returns the color seen along the direction of a ray that missed every object
+	  */
+	virtual glm::vec3 rayTrace(const Ray& ray) = 0;
+
+	/**
+	  * Returns how many texels a unit of length spans on a plane at distance 1
+	  * along the rays, to estimate how many texels a bundle of rays reads. 0
+	  * for environments that are not looked up in textures.
+	  */
+	virtual float getTexelDensity() const { return 0.0f; }
+};
+
+#endif
@@ -34,9 +34,9 @@ public:
 	/**
 	* The fresnel rayTrace function creates a fresnel effect for the objects it affects.
 	*/
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
-
-		glm::vec3 n = glm::normalize(normal);
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+
+		glm::vec3 n = hit.normal;
 		glm::vec3 v = glm::normalize(ray.getDirection());
 
 		if(glm::dot(n, v) < 0.0f){
@@ -48,8 +48,8 @@ public:
 			float reflect_contribution = ray.getColorContribution()*fresnel;
 			float refract_contribution = ray.getColorContribution()*(1.0f-fresnel);
 
-			glm::vec3 reflect = state.rayTrace(ray.spawn(t, refl_dir, reflect_contribution));
-			glm::vec3 refract = state.rayTrace(ray.spawn(t, refract_dir, refract_contribution));
+			glm::vec3 reflect = state.rayTrace(ray.spawn(hit.position, refl_dir, reflect_contribution));
+			glm::vec3 refract = state.rayTrace(ray.spawn(hit.position, refract_dir, refract_contribution));
 
 			return glm::mix(refract, reflect, fresnel);
 		}
@@ -62,8 +62,8 @@ public:
 			float reflect_contribution = ray.getColorContribution()*fresnel;
 			float refract_contribution = ray.getColorContribution()*(1.0f-fresnel);
 
-			glm::vec3 reflect = state.rayTrace(ray.spawn(t, refl_dir, reflect_contribution));
-			glm::vec3 refract = state.rayTrace(ray.spawn(t, refract_dir, refract_contribution));
+			glm::vec3 reflect = state.rayTrace(ray.spawn(hit.position, refl_dir, reflect_contribution));
+			glm::vec3 refract = state.rayTrace(ray.spawn(hit.position, refract_dir, refract_contribution));
 
 			return glm::mix(refract, reflect, fresnel);
 		}
@@ -0,0 +1,67 @@
+#ifndef _FRUSTUM_HPP__
+#define _FRUSTUM_HPP__
+
+#include <glm/glm.hpp>
+
+#include "AABB.hpp"
+
+/**
+  * The volume covered by the rays from one origin through a rectangle on the
+  * screen, such as the primary rays of a screen tile. It is bounded by the four
+  * planes through the origin and the edges of the rectangle, and opens away
+  * from the origin, so nothing behind the camera is inside it.
+  *
+  * The box tests are conservative: a box reported outside holds no point of the
+  * frustum, but a box that is not may still miss it near the corners.
+  */
+struct Frustum {
+	/**
+	  * @param origin The common origin of the rays
+	  * @param corners Directions of the rays through the four corners of the
+	  *        rectangle, in order around it (either way round)
+	  */
+	Frustum(const glm::vec3& origin, const glm::vec3 corners[4])
+		: origin(origin)
+	{
+		const glm::vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+		for (unsigned int k=0; k<4; ++k) {
+			normals[k] = glm::cross(corners[k], corners[(k+1)%4]);
+			//Make the normals point into the frustum
+			if (glm::dot(normals[k], center) < 0.0f) normals[k] = -normals[k];
+			offsets[k] = glm::dot(normals[k], origin);
+		}
+	}
+
+	/**
+	  * Whether box lies entirely on the outer side of one of the planes
+	  */
+	inline bool outside(const AABB& box) const {
+		for (unsigned int k=0; k<4; ++k) {
+			//The corner of the box furthest into the frustum along the normal
+			glm::vec3 p(normals[k].x > 0.0f ? box.max.x : box.min.x,
+				normals[k].y > 0.0f ? box.max.y : box.min.y,
+				normals[k].z > 0.0f ? box.max.z : box.min.z);
+			if (glm::dot(normals[k], p) < offsets[k]) return true;
+		}
+		return false;
+	}
+
+	/**
+	  * Whether all of box lies inside the frustum
+	  */
+	inline bool contains(const AABB& box) const {
+		for (unsigned int k=0; k<4; ++k) {
+			glm::vec3 p(normals[k].x > 0.0f ? box.min.x : box.max.x,
+				normals[k].y > 0.0f ? box.min.y : box.max.y,
+				normals[k].z > 0.0f ? box.min.z : box.max.z);
+			if (glm::dot(normals[k], p) < offsets[k]) return false;
+		}
+		return true;
+	}
+
+	glm::vec3 origin;
+	glm::vec3 normals[4];
+	float offsets[4];
+};
+
+#endif
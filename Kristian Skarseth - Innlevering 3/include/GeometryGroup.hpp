@@ -0,0 +1,80 @@
+#ifndef _GEOMETRYGROUP_HPP__
+#define _GEOMETRYGROUP_HPP__
+
+#include <vector>
+#include <memory>
+#include <limits>
+
+#include "AABB.hpp"
+#include "BVH.hpp"
+#include "Grid.hpp"
+#include "SceneObject.hpp"
+
+/**
+  * A set of primitives in their own object space with their own BVH (the
+  * bottom level of a two level hierarchy). A group is built once and shared
+  * by any number of Instance objects, so memory grows with the unique
+  * geometry and not with the number of copies placed in the scene.
+  *
+  * The primitives are only used for their geometry, shading is done by the
+  * effect of the instance that was hit, so they can be created without an effect.
+  */
+class GeometryGroup {
+public:
+	/**
+	  * @param accelerator Acceleration structure over the primitives of the group,
+	  *                    such as accel::Grid for a cloud of particles
+	  */
+	GeometryGroup(accel::Type accelerator = accel::Auto)
+		: accelerator(accelerator), use_grid(false), built(false) {}
+
+	void addObject(std::shared_ptr<SceneObject> o) {
+		objects.push_back(o);
+		built = false;
+	}
+
+	/**
+	  * Builds the bottom level hierarchy. Called by the instances when they are
+	  * created, adding objects to the group after that is not supported.
+	  */
+	void build() {
+		if (built) return;
+		use_grid = accelerator == accel::Grid || (accelerator == accel::Auto && UniformGrid::suits(objects));
+		if (use_grid) grid.build(objects);
+		else bvh.build(objects);
+		bounds = AABB();
+		for (unsigned int i=0; i<objects.size(); ++i) {
+			bounds.extend(objects[i]->getBoundingBox());
+		}
+		built = true;
+	}
+
+	/**
+	  * Closest intersection with a ray given in object space
+	  * @param hit Set to the primitive that was hit
+	  * @return The ray parameter of the hit, or -1 if nothing was hit
+	  */
+	inline float intersect(const Ray& r, SceneObject*& hit) const {
+		const float z_offset = glm::max(10e-4f, r.getMinT());
+		float t_min = r.getMaxT();
+		bool found = use_grid ? grid.intersect(r, z_offset, t_min, hit) : bvh.intersect(r, z_offset, t_min, hit);
+		if (found) {
+			return t_min;
+		}
+		return -1.0f;
+	}
+
+	inline const AABB& getBoundingBox() const { return bounds; }
+	inline const std::vector<std::shared_ptr<SceneObject> >& getObjects() const { return objects; }
+
+private:
+	std::vector<std::shared_ptr<SceneObject> > objects;
+	accel::Type accelerator;
+	bool use_grid;
+	UniformGrid grid;
+	BVH bvh;
+	AABB bounds;
+	bool built;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef _GRID_HPP__
+#define _GRID_HPP__
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "AABB.hpp"
+#include "Ray.hpp"
+#include "SceneObject.hpp"
+#include "ThreadPool.hpp"
+
+namespace accel{
+	/**
+	  * Selects the acceleration structure for the bounded objects of a scene or group
+	  */
+	enum Type {
+		Auto,      //< A grid if UniformGrid::suits() the objects, otherwise a BVH
+		Hierarchy, //< Always a BVH
+		Grid       //< Always a uniform grid
+	};
+}
+
+/**
+  * Uniform grid over the scene objects, walked with a 3D-DDA. Every object is
+  * listed in each cell its bounding box overlaps, in one flat array indexed
+  * by cell. For many similar sized objects spread evenly through the scene,
+  * such as particle clouds of spheres, it builds in a fraction of the time of
+  * a BVH and the DDA visits cells in order along the ray, so it can stop at the
+  * first cell that holds a hit.
+  *
+  * References:
+  *				John Amanatides and Andrew Woo. 1987. A Fast Voxel Traversal Algorithm for Ray Tracing
+  *				Physically Based Rendering (1st ed) "Grid Accelerator" p168-185
+  */
+class UniformGrid {
+public:
+	UniformGrid() : cell_count(0) {}
+
+	/**
+	  * Builds the grid over objects. Only objects with a finite bounding box
+	  * should be passed in, the rest can not be placed in a cell. The boxes are
+	  * computed on pool, or on OpenMP threads if it is NULL.
+	  */
+	void build(const std::vector<std::shared_ptr<SceneObject> >& objects, ThreadPool* pool = NULL) {
+		clear();
+		if (objects.empty()) return;
+
+		const int n = static_cast<int>(objects.size());
+		std::vector<AABB> boxes(n);
+		parallelFor(pool, 0, n, [&](int i) {
+			boxes[i] = objects[i]->getBoundingBox();
+		});
+
+		glm::vec3 mean_extent(0.0f);
+		for (int i=0; i<n; ++i) {
+			bounds.extend(boxes[i]);
+			mean_extent += boxes[i].extent();
+		}
+		mean_extent /= static_cast<float>(n);
+
+		//Aim for cell_density cells per object, but never make cells smaller than
+		//the average object, as every object would then be listed in many cells
+		glm::vec3 extent = bounds.extent();
+		float max_extent = glm::max(extent.x, glm::max(extent.y, extent.z));
+		glm::vec3 flat_safe = glm::max(extent, glm::vec3(max_extent*1e-3f));
+		float volume = flat_safe.x*flat_safe.y*flat_safe.z;
+		float cell_size = std::pow(volume/(cell_density()*n), 1.0f/3.0f);
+		cell_size = glm::max(cell_size, glm::max(mean_extent.x, glm::max(mean_extent.y, mean_extent.z)));
+
+		for (int a=0; a<3; ++a) {
+			int cells = (cell_size > 0.0f) ? static_cast<int>(extent[a]/cell_size + 0.5f) : 1;
+			resolution[a] = glm::clamp(cells, 1, static_cast<int>(max_resolution));
+			inv_cell_size[a] = (extent[a] > 0.0f) ? resolution[a]/extent[a] : 0.0f;
+			cell_extent[a] = (extent[a] > 0.0f) ? extent[a]/resolution[a] : 0.0f;
+		}
+		cell_count = resolution[0]*resolution[1]*resolution[2];
+
+		//Count the objects of every cell, turn the counts into start offsets,
+		//and then fill in the objects
+		cell_start.assign(cell_count+1, 0);
+		for (int i=0; i<n; ++i) {
+			int lo[3], hi[3];
+			cellRange(boxes[i], lo, hi);
+			for (int z=lo[2]; z<=hi[2]; ++z)
+				for (int y=lo[1]; y<=hi[1]; ++y)
+					for (int x=lo[0]; x<=hi[0]; ++x)
+						cell_start[cellIndex(x, y, z)+1]++;
+		}
+		for (unsigned int c=0; c<cell_count; ++c) {
+			cell_start[c+1] += cell_start[c];
+		}
+		cell_objects.resize(cell_start[cell_count]);
+		std::vector<unsigned int> cursor(cell_start.begin(), cell_start.end()-1);
+		for (int i=0; i<n; ++i) {
+			int lo[3], hi[3];
+			cellRange(boxes[i], lo, hi);
+			for (int z=lo[2]; z<=hi[2]; ++z)
+				for (int y=lo[1]; y<=hi[1]; ++y)
+					for (int x=lo[0]; x<=hi[0]; ++x)
+						cell_objects[cursor[cellIndex(x, y, z)]++] = objects[i].get();
+		}
+	}
+
+	void clear() {
+		bounds = AABB();
+		cell_count = 0;
+		cell_start.clear();
+		cell_objects.clear();
+	}
+
+	/**
+	  * Tells whether a grid is likely to beat a BVH for objects: there must be
+	  * many of them, and their sizes must be close to uniform, as one cell size
+	  * then fits all of them
+	  */
+	static bool suits(const std::vector<std::shared_ptr<SceneObject> >& objects) {
+		if (objects.size() < min_objects) return false;
+
+		double sum = 0.0, sum_squared = 0.0;
+		for (unsigned int i=0; i<objects.size(); ++i) {
+			glm::vec3 e = objects[i]->getBoundingBox().extent();
+			double size = glm::max(e.x, glm::max(e.y, e.z));
+			sum += size;
+			sum_squared += size*size;
+		}
+		double mean = sum/objects.size();
+		if (mean <= 0.0) return false;
+		double variance = std::max(sum_squared/objects.size() - mean*mean, 0.0);
+		return std::sqrt(variance) <= max_size_variation()*mean;
+	}
+
+	inline bool empty() const { return cell_count == 0; }
+	inline unsigned int getCellCount() const { return cell_count; }
+	inline const AABB& getBounds() const { return bounds; }
+
+	/**
+	  * Finds the closest intersection along ray
+	  * @param t_near Intersections closer than this are ignored (self intersection offset)
+	  * @param t_min In: the closest hit found so far. Out: the closest hit found
+	  * @param hit Set to the object that was hit, if any hit closer than t_min was found
+	  * @return true if a closer hit than the incoming t_min was found
+	  */
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, SceneObject*& hit) const {
+		Walk walk;
+		if (!startWalk(ray, t_min, walk)) return false;
+
+		bool found = false;
+		while (true) {
+			for (unsigned int i=cell_start[walk.cell]; i<cell_start[walk.cell+1]; ++i) {
+				SceneObject* object = cell_objects[i];
+				float t = object->intersect(ray);
+				if (t > t_near && t <= t_min) {
+					t_min = t;
+					hit = object;
+					found = true;
+				}
+			}
+			//Objects span several cells, so a hit is only final once the walk
+			//has reached the cell it lies in
+			if (!step(walk, t_min)) break;
+		}
+		return found;
+	}
+
+	/**
+	  * Tests whether anything intersects ray between t_near and t_max, stopping
+	  * at the first such intersection instead of looking for the closest one
+	  */
+	inline bool occluded(const Ray& ray, float t_near, float t_max) const {
+		Walk walk;
+		if (!startWalk(ray, t_max, walk)) return false;
+
+		while (true) {
+			for (unsigned int i=cell_start[walk.cell]; i<cell_start[walk.cell+1]; ++i) {
+				float t = cell_objects[i]->intersect(ray);
+				if (t > t_near && t < t_max) return true;
+			}
+			if (!step(walk, t_max)) break;
+		}
+		return false;
+	}
+
+private:
+	/**
+	  * State of the DDA: the current cell, and for each axis the ray parameter
+	  * of the next cell boundary, how far t moves per cell, and the step
+	  */
+	struct Walk {
+		int position[3];
+		int step[3];
+		int end[3];
+		float t_next[3];
+		float t_delta[3];
+		unsigned int cell;
+	};
+
+	static const unsigned int min_objects = 4096;
+	static const unsigned int max_resolution = 512;
+
+	/**
+	  * Target number of cells per object
+	  */
+	static float cell_density() { return 2.0f; }
+
+	/**
+	  * Largest standard deviation of the object sizes, relative to the mean,
+	  * for which the sizes count as uniform
+	  */
+	static double max_size_variation() { return 0.5; }
+
+	inline unsigned int cellIndex(int x, int y, int z) const {
+		return (z*resolution[1] + y)*resolution[0] + x;
+	}
+
+	inline int toCell(float p, int axis) const {
+		int cell = static_cast<int>((p - bounds.min[axis])*inv_cell_size[axis]);
+		return glm::clamp(cell, 0, resolution[axis]-1);
+	}
+
+	inline void cellRange(const AABB& box, int lo[3], int hi[3]) const {
+		for (int a=0; a<3; ++a) {
+			lo[a] = toCell(box.min[a], a);
+			hi[a] = toCell(box.max[a], a);
+		}
+	}
+
+	/**
+	  * Clips the ray to the grid and sets up the walk from the first cell it enters
+	  * @return false if the ray misses the grid before t_max
+	  */
+	inline bool startWalk(const Ray& ray, float t_max, Walk& walk) const {
+		if (cell_count == 0) return false;
+
+		const glm::vec3 origin = ray.getOrigin();
+		const glm::vec3 dir = ray.getDirection();
+		if (dir.x == 0.0f && dir.y == 0.0f && dir.z == 0.0f) return false;
+		const glm::vec3 inv_dir = ray.getInvDirection();
+
+		glm::vec3 t1 = (bounds.min-origin)*inv_dir;
+		glm::vec3 t2 = (bounds.max-origin)*inv_dir;
+		glm::vec3 t_small = glm::min(t1, t2);
+		glm::vec3 t_large = glm::max(t1, t2);
+		float t_enter = glm::max(glm::max(t_small.x, t_small.y), glm::max(t_small.z, 0.0f));
+		float t_exit = glm::min(glm::min(t_large.x, t_large.y), glm::min(t_large.z, t_max));
+		if (t_enter > t_exit) return false;
+
+		const glm::vec3 entry = origin + t_enter*dir;
+		for (int a=0; a<3; ++a) {
+			walk.position[a] = toCell(entry[a], a);
+			if (dir[a] > 0.0f) {
+				float boundary = bounds.min[a] + (walk.position[a]+1)*cell_extent[a];
+				walk.t_next[a] = (boundary - origin[a])*inv_dir[a];
+				walk.t_delta[a] = cell_extent[a]*inv_dir[a];
+				walk.step[a] = 1;
+				walk.end[a] = resolution[a];
+			}
+			else if (dir[a] < 0.0f) {
+				float boundary = bounds.min[a] + walk.position[a]*cell_extent[a];
+				walk.t_next[a] = (boundary - origin[a])*inv_dir[a];
+				walk.t_delta[a] = -cell_extent[a]*inv_dir[a];
+				walk.step[a] = -1;
+				walk.end[a] = -1;
+			}
+			else {
+				walk.t_next[a] = std::numeric_limits<float>::max();
+				walk.t_delta[a] = 0.0f;
+				walk.step[a] = 0;
+				walk.end[a] = -1;
+			}
+		}
+		walk.cell = cellIndex(walk.position[0], walk.position[1], walk.position[2]);
+		return true;
+	}
+
+	/**
+	  * Moves the walk to the next cell along the ray
+	  * @return false if the ray leaves the grid, or the next cell starts beyond t_max
+	  */
+	inline bool step(Walk& walk, float t_max) const {
+		int axis = (walk.t_next[0] < walk.t_next[1])
+			? ((walk.t_next[0] < walk.t_next[2]) ? 0 : 2)
+			: ((walk.t_next[1] < walk.t_next[2]) ? 1 : 2);
+		if (walk.t_next[axis] >= t_max) return false;
+
+		walk.position[axis] += walk.step[axis];
+		if (walk.position[axis] == walk.end[axis]) return false;
+		walk.t_next[axis] += walk.t_delta[axis];
+		walk.cell = cellIndex(walk.position[0], walk.position[1], walk.position[2]);
+		return true;
+	}
+
+	AABB bounds;
+	int resolution[3];
+	float inv_cell_size[3];
+	float cell_extent[3];
+	unsigned int cell_count;
+	std::vector<unsigned int> cell_start;
+	std::vector<SceneObject*> cell_objects;
+};
+
+#endif
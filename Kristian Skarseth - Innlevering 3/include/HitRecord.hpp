@@ -0,0 +1,21 @@
+#ifndef _HITRECORD_HPP__
+#define _HITRECORD_HPP__
+
+#include <glm/glm.hpp>
+
+/**
+  * The closest intersection of a ray. The object that was hit fills it in once,
+  * through SceneObject::computeHit, and its effect shades from it, so the hit
+  * point and normal are never worked out more than once per ray.
+  */
+struct HitRecord {
+	HitRecord() : t(-1.0f), primitive(0), uv(0.0f), position(0.0f), normal(0.0f) {}
+
+	float t;                //< Ray parameter of the hit
+	unsigned int primitive; //< The part of the object that was hit, such as the triangle of a mesh. 0 for single primitives
+	glm::vec2 uv;           //< Barycentric coordinates of the hit, the weights of the second and third corner of a triangle
+	glm::vec3 position;     //< The hit point, origin + t*direction
+	glm::vec3 normal;       //< Unit surface normal at the hit, interpolated for smooth shaded meshes
+};
+
+#endif
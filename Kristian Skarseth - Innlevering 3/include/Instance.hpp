@@ -0,0 +1,95 @@
+#ifndef _INSTANCE_HPP__
+#define _INSTANCE_HPP__
+
+#include <memory>
+
+#include <glm/glm.hpp>
+
+#include "RayTracerState.hpp"
+#include "SceneObject.hpp"
+#include "SceneObjectEffect.hpp"
+#include "GeometryGroup.hpp"
+
+/**
+  * A copy of a shared GeometryGroup placed in the scene with its own transform
+  * and effect. The instance is a regular scene object with a bounding box,
+  * so the scene BVH acts as the top level hierarchy over all instances, and
+  * rays that reach an instance are moved into object space to walk the
+  * group's own BVH.
+  *
+  * The ray direction is transformed without being normalized, so the ray
+  * parameter t is the same in object and world space.
+  */
+class Instance : public SceneObject {
+public:
+	/**
+	  * @param geometry The shared geometry to place in the scene
+	  * @param transform Object to world transform of this copy
+	  * @param effect Effect used to shade every primitive of this copy
+	  */
+	Instance(std::shared_ptr<GeometryGroup> geometry, glm::mat4 transform, std::shared_ptr<SceneObjectEffect> effect)
+		: SceneObject(effect), geometry(geometry), object_to_world(transform)
+	{
+		world_to_object = glm::inverse(transform);
+		geometry->build();
+	}
+
+	float intersect(const Ray& r) {
+		SceneObject* hit = NULL;
+		return geometry->intersect(toObjectSpace(r), hit);
+	}
+
+	/**
+	  * The hit primitive is not passed on from intersect, so the group is walked
+	  * once more to find it, and it fills in the hit in object space
+	  */
+	void computeHit(const Ray& r, HitRecord& hit) {
+		//The ray may already be clipped at this hit, and box tests that round
+		//the other way would then miss it, so the group is searched unclipped
+		Ray local = toObjectSpace(r);
+		local.setInterval(r.getMinT(), std::numeric_limits<float>::max());
+		SceneObject* object = NULL;
+		if (geometry->intersect(local, object) < 0.0f) {
+			hit.position = r.getOrigin() + hit.t*r.getDirection();
+			return;
+		}
+		object->computeHit(local, hit);
+		hit.position = r.getOrigin() + hit.t*r.getDirection();
+		//Normals go through the inverse transpose, so non-uniform scaling keeps them perpendicular
+		hit.normal = glm::normalize(glm::vec3(glm::transpose(world_to_object)*glm::vec4(hit.normal, 0.0f)));
+	}
+
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return effect->rayTrace(ray, hit, state);
+	}
+
+	/**
+	  * The world space box around the transformed corners of the group's box
+	  */
+	AABB getBoundingBox() {
+		const AABB& local = geometry->getBoundingBox();
+		AABB box;
+		for (int i=0; i<8; ++i) {
+			glm::vec3 corner((i & 1) ? local.max.x : local.min.x,
+							 (i & 2) ? local.max.y : local.min.y,
+							 (i & 4) ? local.max.z : local.min.z);
+			box.extend(glm::vec3(object_to_world*glm::vec4(corner, 1.0f)));
+		}
+		return box;
+	}
+
+private:
+	inline Ray toObjectSpace(const Ray& r) const {
+		//The transform is affine, so a ray parameter means the same point in both spaces
+		Ray local(glm::vec3(world_to_object*glm::vec4(r.getOrigin(), 1.0f)),
+				  glm::vec3(world_to_object*glm::vec4(r.getDirection(), 0.0f)));
+		local.setInterval(r.getMinT(), r.getMaxT());
+		return local;
+	}
+
+	std::shared_ptr<GeometryGroup> geometry;
+	glm::mat4 object_to_world;
+	glm::mat4 world_to_object;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef _MAPPEDFILE_HPP__
+#define _MAPPEDFILE_HPP__
+
+#include <string>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX //< windows.h would otherwise break std::min and glm::min
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+  * A read only view of a whole file mapped into memory. Pages are loaded by
+  * the OS on first touch, so opening even a large file is close to free, and
+  * processes mapping the same file share its pages.
+  */
+class MappedFile {
+public:
+	/**
+	  * Maps filename into memory
+	  * @throws std::runtime_error if the file can not be opened or mapped
+	  */
+	MappedFile(const std::string& filename) : data(NULL), size(0) {
+#ifdef _WIN32
+		mapping = NULL;
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Unable to open " + filename);
+		}
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size = static_cast<size_t>(file_size.QuadPart);
+		if (size > 0) {
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping != NULL) {
+				data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			}
+			if (data == NULL) {
+				close();
+				throw std::runtime_error("Unable to map " + filename);
+			}
+		}
+#else
+		file = open(filename.c_str(), O_RDONLY);
+		if (file < 0) {
+			throw std::runtime_error("Unable to open " + filename);
+		}
+		struct stat buffer;
+		fstat(file, &buffer);
+		size = static_cast<size_t>(buffer.st_size);
+		if (size > 0) {
+			void* view = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+			if (view == MAP_FAILED) {
+				close();
+				throw std::runtime_error("Unable to map " + filename);
+			}
+			data = static_cast<const char*>(view);
+		}
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	inline const char* getData() const { return data; }
+	inline size_t getSize() const { return size; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	void close() {
+#ifdef _WIN32
+		if (data != NULL) UnmapViewOfFile(data);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != NULL) munmap(const_cast<char*>(data), size);
+		if (file >= 0) ::close(file);
+		file = -1;
+#endif
+		data = NULL;
+	}
+
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+};
+
+#endif
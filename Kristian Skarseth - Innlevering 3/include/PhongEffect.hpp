@@ -24,13 +24,13 @@ public:
 		this->spec = spec;
 	}
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
-		glm::vec3 p = ray.getOrigin() + t*ray.getDirection();
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		const glm::vec3& p = hit.position;
 		
 		glm::vec3 v = glm::normalize(ray.getOrigin() - p);
 		glm::vec3 l = glm::normalize(this->pos - p);
 		glm::vec3 h = glm::normalize(v + l);
-		glm::vec3 n = glm::normalize(normal);
+		const glm::vec3& n = hit.normal;
 
 		float diffuse = glm::max(0.0f, glm::dot(n, l));
 		float specular = glm::pow( glm::max(0.0f, glm::dot(n, h)), 30.0f);
@@ -0,0 +1,266 @@
+#ifndef _PRIMITIVESTORE_HPP__
+#define _PRIMITIVESTORE_HPP__
+
+#include <vector>
+#include <memory>
+#include <typeinfo>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+#include "SceneObject.hpp"
+#include "HitRecord.hpp"
+#include "BVH.hpp"
+#include "WideBVH.hpp"
+
+class RayTracerState;
+
+namespace prim {
+	/**
+	  * A compile time list of primitive types, such as
+	  * List<Sphere, List<Triangle, List<Quad> > >
+	  */
+	struct End {};
+	template <class Head, class Tail = End> struct List {};
+
+	/**
+	  * One array per type of Types, holding copies of the scene objects of that
+	  * type. A primitive is found by its kind, the position of its type in the
+	  * list, and its slot in the array of that type.
+	  */
+	template <class Types> struct Arrays;
+
+	template <> struct Arrays<End> {
+		static const unsigned int count = 0;
+
+		inline void clear() {}
+		inline bool add(SceneObject*, unsigned int&, unsigned int&) { return false; }
+		inline float intersect(unsigned int, unsigned int, const Ray&) { return -1.0f; }
+		inline glm::vec3 rayTrace(unsigned int, unsigned int, Ray&, HitRecord&, RayTracerState&) { return glm::vec3(0.0f); }
+	};
+
+	template <class Head, class Tail> struct Arrays<List<Head, Tail> > {
+		static const unsigned int count = Arrays<Tail>::count + 1;
+
+		inline void clear() {
+			items.clear();
+			rest.clear();
+		}
+
+		/**
+		  * Copies object into the array of its type. Only objects of exactly a
+		  * listed type are taken, as a subclass may override intersect.
+		  * @return false if the type of object is not in the list
+		  */
+		inline bool add(SceneObject* object, unsigned int& kind, unsigned int& slot) {
+			if (typeid(*object) == typeid(Head)) {
+				kind = 0;
+				slot = static_cast<unsigned int>(items.size());
+				items.push_back(*static_cast<Head*>(object));
+				return true;
+			}
+			if (!rest.add(object, kind, slot)) return false;
+			++kind;
+			return true;
+		}
+
+		//The calls are qualified with the type, so they are bound at compile
+		//time and can be inlined into the traversal
+		inline float intersect(unsigned int kind, unsigned int slot, const Ray& ray) {
+			if (kind == 0) return items[slot].Head::intersect(ray);
+			return rest.intersect(kind-1, slot, ray);
+		}
+
+		inline glm::vec3 rayTrace(unsigned int kind, unsigned int slot, Ray& ray, HitRecord& hit, RayTracerState& state) {
+			if (kind == 0) {
+				items[slot].Head::computeHit(ray, hit);
+				return items[slot].Head::rayTrace(ray, hit, state);
+			}
+			return rest.rayTrace(kind-1, slot, ray, hit, state);
+		}
+
+		std::vector<Head> items;
+		Arrays<Tail> rest;
+	};
+}
+
+/**
+  * Intersects the bounded scene objects without a virtual call per object.
+  * RayTracerState makes one call here per ray, and the implementation walks
+  * the acceleration structure with the primitive tests bound at compile time.
+  */
+class PrimitiveDispatch {
+public:
+	virtual ~PrimitiveDispatch() {}
+
+	/**
+	  * Takes in the objects the trees were built over, and the trees to walk.
+	  * Must be called again whenever the trees are rebuilt or refitted, as the
+	  * objects are copied.
+	  */
+	virtual void update(const std::vector<std::shared_ptr<SceneObject> >& objects,
+		const BVH& bvh, const WideBVH<4>& bvh4, const WideBVH<8>& bvh8) = 0;
+
+	/**
+	  * Same contract as BVH::intersect, with hit set to the index of the object
+	  */
+	virtual bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit) = 0;
+
+	/**
+	  * Same contract as BVH::intersect for packets, walking the binary tree
+	  */
+	virtual unsigned int intersect(RayPacket<4>& packet, float t_near) = 0;
+	virtual unsigned int intersect(RayPacket<8>& packet, float t_near) = 0;
+	virtual unsigned int intersect(RayPacket<16>& packet, float t_near) = 0;
+
+	/**
+	  * Same contract as the BVH::intersect overloads through the subtrees found
+	  * by BVH::cull(), which walk the binary tree
+	  */
+	virtual bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit,
+		const unsigned int* entries, unsigned int entry_count) = 0;
+	virtual unsigned int intersect(RayPacket<4>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) = 0;
+	virtual unsigned int intersect(RayPacket<8>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) = 0;
+	virtual unsigned int intersect(RayPacket<16>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) = 0;
+
+	/**
+	  * Same contract as BVH::occluded
+	  */
+	virtual bool occluded(const Ray& ray, float t_near, float t_max) = 0;
+
+	/**
+	  * Fills in the rest of hit, with hit.t set, and shades it for the object
+	  * index returned by intersect
+	  */
+	virtual glm::vec3 rayTrace(unsigned int object, Ray& ray, HitRecord& hit, RayTracerState& state) = 0;
+};
+
+/**
+  * Keeps each primitive type of Types in its own contiguous array, filled in
+  * the leaf order of the tree, so the traversal reads them roughly front to
+  * back. Objects of other types, such as instances or user defined objects,
+  * are called through the virtual SceneObject interface as before.
+  *
+  * The arrays hold copies, so objects moved after update() are only seen once
+  * the scene is refitted.
+  */
+template <class Types>
+class PrimitiveStore : public PrimitiveDispatch {
+public:
+	PrimitiveStore() : bvh(NULL), bvh4(NULL), bvh8(NULL) {}
+
+	void update(const std::vector<std::shared_ptr<SceneObject> >& objects,
+		const BVH& bvh, const WideBVH<4>& bvh4, const WideBVH<8>& bvh8) {
+		this->bvh = &bvh;
+		this->bvh4 = &bvh4;
+		this->bvh8 = &bvh8;
+
+		arrays.clear();
+		others.clear();
+		entries.assign(objects.size(), Entry());
+		std::vector<bool> placed(objects.size(), false);
+
+		//Spatial splits list some objects in several leaves, they are stored once
+		const unsigned int* index = bvh.getIndexData();
+		for (unsigned int i=0; i<bvh.getIndexCount(); ++i) {
+			if (placed[index[i]]) continue;
+			placed[index[i]] = true;
+			place(objects[index[i]].get(), entries[index[i]]);
+		}
+	}
+
+	bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit) {
+		if (bvh == NULL) return false;
+		if (!bvh8->empty()) return bvh8->intersect(ray, t_near, t_min, hit, Primitives(*this));
+		if (!bvh4->empty()) return bvh4->intersect(ray, t_near, t_min, hit, Primitives(*this));
+		return bvh->intersect(ray, t_near, t_min, hit, Primitives(*this));
+	}
+
+	unsigned int intersect(RayPacket<4>& packet, float t_near) { return intersectPacket(packet, t_near); }
+	unsigned int intersect(RayPacket<8>& packet, float t_near) { return intersectPacket(packet, t_near); }
+	unsigned int intersect(RayPacket<16>& packet, float t_near) { return intersectPacket(packet, t_near); }
+
+	bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit,
+		const unsigned int* entries, unsigned int entry_count) {
+		if (bvh == NULL) return false;
+		return bvh->intersect(ray, t_near, t_min, hit, entries, entry_count, Primitives(*this));
+	}
+
+	unsigned int intersect(RayPacket<4>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) {
+		return intersectPacket(packet, t_near, entries, entry_count);
+	}
+	unsigned int intersect(RayPacket<8>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) {
+		return intersectPacket(packet, t_near, entries, entry_count);
+	}
+	unsigned int intersect(RayPacket<16>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) {
+		return intersectPacket(packet, t_near, entries, entry_count);
+	}
+
+	bool occluded(const Ray& ray, float t_near, float t_max) {
+		if (bvh == NULL) return false;
+		if (!bvh8->empty()) return bvh8->occluded(ray, t_near, t_max, Primitives(*this));
+		if (!bvh4->empty()) return bvh4->occluded(ray, t_near, t_max, Primitives(*this));
+		return bvh->occluded(ray, t_near, t_max, Primitives(*this));
+	}
+
+	glm::vec3 rayTrace(unsigned int object, Ray& ray, HitRecord& hit, RayTracerState& state) {
+		const Entry& entry = entries[object];
+		if (entry.kind == fallback) {
+			others[entry.slot]->computeHit(ray, hit);
+			return others[entry.slot]->rayTrace(ray, hit, state);
+		}
+		return arrays.rayTrace(entry.kind, entry.slot, ray, hit, state);
+	}
+
+private:
+	static const unsigned int fallback = prim::Arrays<Types>::count;
+
+	struct Entry {
+		unsigned int kind;
+		unsigned int slot;
+	};
+
+	/**
+	  * Lets the traversal templates intersect the stored primitives
+	  */
+	struct Primitives {
+		Primitives(PrimitiveStore& store) : store(store) {}
+		inline float intersect(unsigned int object, const Ray& ray) const { return store.intersectObject(object, ray); }
+		PrimitiveStore& store;
+	};
+
+	template <unsigned int Size>
+	inline unsigned int intersectPacket(RayPacket<Size>& packet, float t_near) {
+		if (bvh == NULL) return 0;
+		return bvh->intersect(packet, t_near, Primitives(*this));
+	}
+
+	template <unsigned int Size>
+	inline unsigned int intersectPacket(RayPacket<Size>& packet, float t_near, const unsigned int* entries, unsigned int entry_count) {
+		if (bvh == NULL) return 0;
+		return bvh->intersect(packet, t_near, entries, entry_count, Primitives(*this));
+	}
+
+	inline void place(SceneObject* object, Entry& entry) {
+		if (!arrays.add(object, entry.kind, entry.slot)) {
+			entry.kind = fallback;
+			entry.slot = static_cast<unsigned int>(others.size());
+			others.push_back(object);
+		}
+	}
+
+	inline float intersectObject(unsigned int object, const Ray& ray) {
+		const Entry& entry = entries[object];
+		if (entry.kind == fallback) return others[entry.slot]->intersect(ray);
+		return arrays.intersect(entry.kind, entry.slot, ray);
+	}
+
+	prim::Arrays<Types> arrays;
+	std::vector<SceneObject*> others;
+	std::vector<Entry> entries;
+	const BVH* bvh;
+	const WideBVH<4>* bvh4;
+	const WideBVH<8>* bvh8;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef _QUAD_HPP__
+#define _QUAD_HPP__
+
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+
+#include "RayTracerState.hpp"
+#include "SceneObject.hpp"
+#include "SceneObjectEffect.hpp"
+
+/**
+  * A planar convex quadrilateral, such as a floor or a wall. Points of its
+  * plane are measured in the quad's own coordinates (u, v), where p0 is (0, 0),
+  * p1 is (1, 0) and p3 is (0, 1), and a point is inside when it is on the inner
+  * side of all four edges. The edges from p0 are the u and v axes, so only the
+  * two far edges need edge functions. The frame and the edge functions are set
+  * up once, so the hit test is one plane distance, two dot products and two
+  * edge functions, and it is exact for any convex quad, not only for axis
+  * aligned rectangles.
+  */
+class Quad : public SceneObject {
+public:
+	/**
+	* Creates a quad from the 4 corners p0, p1, p2 and p3. For the normal of the surface to be correct,
+	  the corners should be in counter clockwise order (as in openGL).
+	* @throws std::runtime_error if the corners do not form a convex quad
+	*/
+	Quad(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, std::shared_ptr<SceneObjectEffect> effect)
+		: SceneObject(effect)
+	{
+		setCorners(p0, p1, p2, p3);
+	}
+
+	/**
+	* Moves the corners of the quad, for animation. The scene must be refitted afterwards.
+	  Corners off the plane of the quad are moved onto it along its normal.
+	* @throws std::runtime_error if the corners do not form a convex quad
+	*/
+	void setCorners(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, glm::vec3 p3) {
+		//The cross product of the diagonals is the mean normal of the two
+		//triangle pairs, so it suits slightly bent quads best
+		glm::vec3 n = glm::cross(p2-p0, p3-p1);
+		if (glm::dot(n, n) == 0.0f) {
+			throw std::runtime_error("Quad has no area");
+		}
+		normal = glm::normalize(n);
+		plane_offset = glm::dot(normal, p0);
+
+		corners[0] = p0;
+		corners[1] = p1 - glm::dot(p1-p0, normal)*normal;
+		corners[2] = p2 - glm::dot(p2-p0, normal)*normal;
+		corners[3] = p3 - glm::dot(p3-p0, normal)*normal;
+
+		//Dual basis of the edges from p0, so dot(p-p0, u_axis) and
+		//dot(p-p0, v_axis) are the coordinates of p along them
+		const glm::vec3 e1 = corners[1]-corners[0];
+		const glm::vec3 e2 = corners[3]-corners[0];
+		const float area = glm::dot(glm::cross(e1, e2), normal);
+		if (area <= 0.0f) {
+			throw std::runtime_error("Quad corners must form a convex polygon, in order around it");
+		}
+		u_axis = glm::cross(e2, normal)/area;
+		v_axis = glm::cross(normal, e1)/area;
+
+		glm::vec2 uv[4] = { glm::vec2(0.0f), glm::vec2(1.0f, 0.0f),
+			glm::vec2(glm::dot(corners[2]-p0, u_axis), glm::dot(corners[2]-p0, v_axis)), glm::vec2(0.0f, 1.0f) };
+		glm::vec3 edges[4];
+		for (int k=0; k<4; ++k) {
+			edges[k] = edgeFunction(uv[k], uv[(k+1)%4]);
+		}
+		for (int k=0; k<4; ++k) {
+			//The two corners off each edge must be inside it
+			for (int j=2; j<4; ++j) {
+				const glm::vec2& corner = uv[(k+j)%4];
+				if (edges[k].x*corner.x + edges[k].y*corner.y + edges[k].z <= 0.0f) {
+					throw std::runtime_error("Quad corners must form a convex polygon, in order around it");
+				}
+			}
+		}
+		far_edges[0] = edges[1];
+		far_edges[1] = edges[2];
+	}
+
+	float intersect(const Ray& r) {
+		glm::vec2 uv;
+		return intersectQuad(r, uv);
+	}
+
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return effect->rayTrace(ray, hit, state);
+	}
+
+	/**
+	  * The uv of the hit are its (u, v) coordinates, which are the texture
+	  * coordinates of a parallelogram
+	  */
+	void computeHit(const Ray& r, HitRecord& hit) {
+		intersectQuad(r, hit.uv);
+		hit.position = r.getOrigin() + hit.t*r.getDirection();
+		hit.normal = normal;
+	}
+
+	AABB getBoundingBox() {
+		AABB box;
+		for (int k=0; k<4; ++k) box.extend(corners[k]);
+		return box;
+	}
+
+	AABB getClippedBoundingBox(const AABB& box) {
+		return AABB::clipPolygon(corners, 4, box);
+	}
+
+	unsigned int getClipShape(float* values) {
+		for (int k=0; k<4; ++k) {
+			values[3*k] = corners[k].x;
+			values[3*k+1] = corners[k].y;
+			values[3*k+2] = corners[k].z;
+		}
+		return 12;
+	}
+
+protected:
+	inline float intersectQuad(const Ray& r, glm::vec2& uv) const {
+		const float den = glm::dot(normal, r.getDirection());
+		if (den == 0.0f) {
+			return -1.0f; //The ray is parallel to the plane
+		}
+		const float t = (plane_offset - glm::dot(normal, r.getOrigin()))/den;
+		if (t < 0.0f) {
+			return -1.0f;
+		}
+
+		const glm::vec3 p = r.getOrigin() + t*r.getDirection() - corners[0];
+		uv = glm::vec2(glm::dot(p, u_axis), glm::dot(p, v_axis));
+		const float e1 = far_edges[0].x*uv.x + far_edges[0].y*uv.y + far_edges[0].z;
+		const float e2 = far_edges[1].x*uv.x + far_edges[1].y*uv.y + far_edges[1].z;
+		if (glm::min(glm::min(uv.x, uv.y), glm::min(e1, e2)) < 0.0f) {
+			return -1.0f;
+		}
+		return t;
+	}
+
+	/**
+	  * Returns (a, b, c) so that a*u + b*v + c is positive on the left of the
+	  * edge from corner from to corner to, which is the inner side
+	  */
+	static glm::vec3 edgeFunction(const glm::vec2& from, const glm::vec2& to) {
+		const glm::vec2 edge = to - from;
+		return glm::vec3(-edge.y, edge.x, edge.y*from.x - edge.x*from.y);
+	}
+
+	glm::vec3 corners[4];
+	glm::vec3 normal;
+	float plane_offset;
+	glm::vec3 u_axis, v_axis;
+	glm::vec3 far_edges[2]; //< Edge functions of the edges p1 to p2 and p2 to p3
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _RADIXSORT_HPP__
+#define _RADIXSORT_HPP__
+
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+/**
+  * Parallel least significant digit radix sort of 32 bit keys, carrying a
+  * value along with every key. Each pass sorts on 8 bits: the input is cut
+  * into one slice per thread, a histogram is built over every slice, the
+  * histograms are prefix summed in slice order, and every slice is then
+  * scattered. Since each slice keeps its order the sort is stable, which
+  * LSD radix sort depends on.
+  *
+  * @param keys The keys to sort, sorted in place
+  * @param values Values that are permuted along with the keys
+  * @param key_bits Number of low bits in the keys that are in use
+  * @param pool Threads to sort on, or NULL for OpenMP threads
+  */
+inline void parallelRadixSort(std::vector<unsigned int>& keys, std::vector<unsigned int>& values, unsigned int key_bits = 32, ThreadPool* pool = NULL) {
+	const unsigned int radix_bits = 8;
+	const unsigned int radix = 1 << radix_bits;
+	const int n = static_cast<int>(keys.size());
+	if (n <= 1) return;
+
+	std::vector<unsigned int> keys_tmp(n);
+	std::vector<unsigned int> values_tmp(n);
+
+	const int slices = static_cast<int>(threadCount(pool));
+	std::vector<unsigned int> histograms(slices*radix);
+
+	for (unsigned int shift=0; shift<key_bits; shift+=radix_bits) {
+		parallelFor(pool, 0, slices, [&](int slice) {
+			const int begin = static_cast<int>((static_cast<long long>(n)*slice)/slices);
+			const int end = static_cast<int>((static_cast<long long>(n)*(slice+1))/slices);
+			unsigned int* histogram = &histograms[slice*radix];
+
+			for (unsigned int d=0; d<radix; ++d) histogram[d] = 0;
+			for (int i=begin; i<end; ++i) {
+				histogram[(keys[i] >> shift) & (radix-1)]++;
+			}
+		});
+
+		//Turn the counts into scatter offsets, digit major and slice minor
+		unsigned int sum = 0;
+		for (unsigned int d=0; d<radix; ++d) {
+			for (int t=0; t<slices; ++t) {
+				unsigned int count = histograms[t*radix+d];
+				histograms[t*radix+d] = sum;
+				sum += count;
+			}
+		}
+
+		parallelFor(pool, 0, slices, [&](int slice) {
+			const int begin = static_cast<int>((static_cast<long long>(n)*slice)/slices);
+			const int end = static_cast<int>((static_cast<long long>(n)*(slice+1))/slices);
+			unsigned int* histogram = &histograms[slice*radix];
+
+			for (int i=begin; i<end; ++i) {
+				unsigned int dest = histogram[(keys[i] >> shift) & (radix-1)]++;
+				keys_tmp[dest] = keys[i];
+				values_tmp[dest] = values[i];
+			}
+		});
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+#endif
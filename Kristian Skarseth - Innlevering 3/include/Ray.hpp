@@ -1,16 +1,24 @@
 #ifndef _RAY_HPP__
 #define _RAY_HPP__
 
+#include <limits>
+
 #include <glm/glm.hpp>
 
 /**
   * The ray class holds the state information of a ray in our ray-tracer:
-  * point of origin and direction
+  * point of origin and direction, and the interval [t_min, t_max] of the ray
+  * parameter that is still searched for hits.
+  *
+  * The reciprocal of the direction is computed once when the ray is made, so
+  * the box tests of the traversal need no divisions, and its signs give the
+  * order to visit children in. The whole ray is 48 bytes.
   */
 class Ray {
 public:
 	Ray(glm::vec3 origin, glm::vec3 direction, float color_contribution = 1.0f)
-		: origin(origin), direction(direction), color_contribution(color_contribution), depth(0) {
+		: origin(origin), direction(direction), inv_direction(1.0f/direction),
+		  t_min(0.0f), t_max(std::numeric_limits<float>::max()), color_contribution(color_contribution) {
 	}
 
 	/**
@@ -23,20 +31,53 @@ public:
 	  */
 	inline const glm::vec3& getDirection() const { return direction; }
 
+	/**
+	  * Returns 1/direction, per component, for slab tests against boxes
+	  */
+	inline const glm::vec3& getInvDirection() const { return inv_direction; }
+
+	/**
+	  * Returns bit a set for each axis a (0=x, 1=y, 2=z) the ray points down
+	  * along. Read from the sign bits of the reciprocal direction, so it also
+	  * tells -0 from +0 as the slab test does.
+	  */
+	inline unsigned int getSigns() const {
+		return (inv_direction.x < 0.0f ? 1u : 0u) | (inv_direction.y < 0.0f ? 2u : 0u) | (inv_direction.z < 0.0f ? 4u : 0u);
+	}
+
+	/**
+	  * Returns the interval of the ray parameter searched for hits
+	  */
+	inline float getMinT() const { return t_min; }
+	inline float getMaxT() const { return t_max; }
+
+	/**
+	  * Sets the interval of the ray parameter searched for hits
+	  */
+	inline void setInterval(float t_min, float t_max) {
+		this->t_min = t_min;
+		this->t_max = t_max;
+	}
+
+	/**
+	  * Ends the ray at t, as when a hit at t is found and only closer hits
+	  * matter any more. Never makes the ray longer.
+	  */
+	inline void clip(float t) {
+		if (t < t_max) t_max = t;
+	}
+
 	/**
 	* Returns the final color contribution value of this ray
 	*/
-	inline float getColorContribution(){return color_contribution;}
+	inline float getColorContribution() const {return color_contribution;}
 
 	/**
-	  * Spanws a new ray from this ray originating from getOrigin() + t*getDirection() 
-	  * going in the direction of d
+	  * Spanws a new ray from this ray originating from point, the hit point
+	  * getOrigin() + t*getDirection(), going in the direction of d
 	  */
-	inline Ray spawn(float t, glm::vec3 d, float color_contribution) const {
-		Ray r(getOrigin()+t*getDirection() + d * 0.001f, d, color_contribution);
-		//Ray r( (getOrigin()+0.00002f) + t * getDirection(), d, color_contribution);
-		r.depth = this->depth + 1;
-		return r;
+	inline Ray spawn(const glm::vec3& point, glm::vec3 d, float color_contribution) const {
+		return Ray(point + d * 0.001f, d, color_contribution);
 	}
 
 	/**
@@ -44,7 +85,6 @@ public:
 	  */
 	inline bool isValid() const {
 		return (color_contribution > 0.002f);
-		//return (depth < max_depth);
 	}
 
 
@@ -52,17 +92,16 @@ public:
 	  * Invalidate ray, saying it should not be raytraced further
 	  */
 	inline void invalidate() {
-		this->depth = max_depth;
+		color_contribution = 0.0f;
 	}
 
 private:
-	friend class RayTracer;
-	float color_contribution;
-
-	static const unsigned int max_depth = 7;
-	unsigned int depth;
 	glm::vec3 origin;
 	glm::vec3 direction;
+	glm::vec3 inv_direction;
+	float t_min;
+	float t_max;
+	float color_contribution;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,167 @@
+#ifndef _RAYPACKET_HPP__
+#define _RAYPACKET_HPP__
+
+#include <limits>
+
+#include <glm/glm.hpp>
+
+#include "SIMD.hpp"
+#include "AABB.hpp"
+#include "Ray.hpp"
+
+/**
+  * A group of Size rays (4, 8 or 16) that walk the BVH together, such as the
+  * samples of one pixel. Every node box is tested against all rays of the
+  * packet at once with SIMD, so for coherent rays one node fetch and one
+  * test serve all of them. The origins and inverse directions are kept as
+  * separate x, y and z arrays for the SIMD loads.
+  *
+  * Bit k of a ray mask stands for ray k of the packet.
+  */
+template <unsigned int Size>
+struct RayPacket {
+	/**
+	  * @param rays Size rays, which must outlive the packet
+	  */
+	RayPacket(const Ray* rays) : rays(rays), active(all()), level(simd::level()) {
+		for (unsigned int k=0; k<Size; ++k) {
+			const glm::vec3& origin = rays[k].getOrigin();
+			const glm::vec3& inv_dir = rays[k].getInvDirection();
+			origin_x[k] = origin.x;
+			origin_y[k] = origin.y;
+			origin_z[k] = origin.z;
+			inv_dir_x[k] = inv_dir.x;
+			inv_dir_y[k] = inv_dir.y;
+			inv_dir_z[k] = inv_dir.z;
+			t_min[k] = rays[k].getMaxT();
+			hit[k] = 0;
+		}
+	}
+
+	static inline unsigned int all() { return (1u << Size) - 1; }
+
+	/**
+	  * Whether all rays point into the same octant, so one near to far order
+	  * of the children of a node suits every ray. Packets that are not should
+	  * be traced as single rays.
+	  */
+	inline bool isCoherent() const {
+		for (unsigned int k=1; k<Size; ++k) {
+			if ((inv_dir_x[k] < 0.0f) != (inv_dir_x[0] < 0.0f)
+				|| (inv_dir_y[k] < 0.0f) != (inv_dir_y[0] < 0.0f)
+				|| (inv_dir_z[k] < 0.0f) != (inv_dir_z[0] < 0.0f)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	  * Tests the rays of mask against box, each up to its own t_min, with the
+	  * widest kernel of the level the packet was made at
+	  * @return The rays of mask that hit the box
+	  */
+	inline unsigned int intersect(const AABB& box, unsigned int mask) const {
+#if defined(RAYTRACER_AVX512)
+		if (Size == 16 && level >= simd::AVX512) return intersectAVX512(box) & mask;
+#endif
+#if defined(RAYTRACER_AVX)
+		if (Size >= 8 && level >= simd::AVX) return intersectAVX(box, mask) & mask;
+#endif
+#if defined(RAYTRACER_SSE)
+		if (level >= simd::SSE) return intersectSSE(box, mask) & mask;
+#endif
+		unsigned int hits = 0;
+		for (unsigned int k=0; k<Size; ++k) {
+			if (!(mask & (1u << k))) continue;
+			glm::vec3 origin(origin_x[k], origin_y[k], origin_z[k]);
+			glm::vec3 inv_dir(inv_dir_x[k], inv_dir_y[k], inv_dir_z[k]);
+			if (box.intersect(origin, inv_dir, t_min[k])) hits |= 1u << k;
+		}
+		return hits;
+	}
+
+	const Ray* rays;
+	unsigned int active;    //< Rays still to be traced
+	float origin_x[Size], origin_y[Size], origin_z[Size];
+	float inv_dir_x[Size], inv_dir_y[Size], inv_dir_z[Size];
+	float t_min[Size];      //< Closest hit of each ray so far
+	unsigned int hit[Size]; //< Primitive index of each closest hit
+	simd::Level level;      //< Kernels to test boxes with
+
+private:
+#if defined(RAYTRACER_SSE)
+	inline unsigned int intersectSSE(const AABB& box, unsigned int mask) const {
+		const __m128 min_x = _mm_set1_ps(box.min.x), min_y = _mm_set1_ps(box.min.y), min_z = _mm_set1_ps(box.min.z);
+		const __m128 max_x = _mm_set1_ps(box.max.x), max_y = _mm_set1_ps(box.max.y), max_z = _mm_set1_ps(box.max.z);
+		const __m128 zero = _mm_setzero_ps();
+		unsigned int hits = 0;
+		for (unsigned int c=0; c<Size; c+=4) {
+			if (((mask >> c) & 0xFu) == 0) continue;
+			const __m128 ox = _mm_loadu_ps(origin_x+c), oy = _mm_loadu_ps(origin_y+c), oz = _mm_loadu_ps(origin_z+c);
+			const __m128 ix = _mm_loadu_ps(inv_dir_x+c), iy = _mm_loadu_ps(inv_dir_y+c), iz = _mm_loadu_ps(inv_dir_z+c);
+			__m128 tx1 = _mm_mul_ps(_mm_sub_ps(min_x, ox), ix);
+			__m128 tx2 = _mm_mul_ps(_mm_sub_ps(max_x, ox), ix);
+			__m128 ty1 = _mm_mul_ps(_mm_sub_ps(min_y, oy), iy);
+			__m128 ty2 = _mm_mul_ps(_mm_sub_ps(max_y, oy), iy);
+			__m128 tz1 = _mm_mul_ps(_mm_sub_ps(min_z, oz), iz);
+			__m128 tz2 = _mm_mul_ps(_mm_sub_ps(max_z, oz), iz);
+			__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)),
+				_mm_max_ps(_mm_min_ps(tz1, tz2), zero));
+			__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)),
+				_mm_min_ps(_mm_max_ps(tz1, tz2), _mm_loadu_ps(t_min+c)));
+			hits |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << c;
+		}
+		return hits;
+	}
+#endif
+
+#if defined(RAYTRACER_AVX)
+	RAYTRACER_TARGET_AVX unsigned int intersectAVX(const AABB& box, unsigned int mask) const {
+		const __m256 min_x = _mm256_set1_ps(box.min.x), min_y = _mm256_set1_ps(box.min.y), min_z = _mm256_set1_ps(box.min.z);
+		const __m256 max_x = _mm256_set1_ps(box.max.x), max_y = _mm256_set1_ps(box.max.y), max_z = _mm256_set1_ps(box.max.z);
+		const __m256 zero = _mm256_setzero_ps();
+		unsigned int hits = 0;
+		for (unsigned int c=0; c<Size; c+=8) {
+			if (((mask >> c) & 0xFFu) == 0) continue;
+			const __m256 ox = _mm256_loadu_ps(origin_x+c), oy = _mm256_loadu_ps(origin_y+c), oz = _mm256_loadu_ps(origin_z+c);
+			const __m256 ix = _mm256_loadu_ps(inv_dir_x+c), iy = _mm256_loadu_ps(inv_dir_y+c), iz = _mm256_loadu_ps(inv_dir_z+c);
+			__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(min_x, ox), ix);
+			__m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(max_x, ox), ix);
+			__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(min_y, oy), iy);
+			__m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(max_y, oy), iy);
+			__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(min_z, oz), iz);
+			__m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(max_z, oz), iz);
+			__m256 t0 = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)),
+				_mm256_max_ps(_mm256_min_ps(tz1, tz2), zero));
+			__m256 t1 = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)),
+				_mm256_min_ps(_mm256_max_ps(tz1, tz2), _mm256_loadu_ps(t_min+c)));
+			hits |= static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))) << c;
+		}
+		return hits;
+	}
+#endif
+
+#if defined(RAYTRACER_AVX512)
+	/**
+	  * Only used for packets of 16, which fill one register
+	  */
+	RAYTRACER_TARGET_AVX512 unsigned int intersectAVX512(const AABB& box) const {
+		const __m512 ox = _mm512_loadu_ps(origin_x), oy = _mm512_loadu_ps(origin_y), oz = _mm512_loadu_ps(origin_z);
+		const __m512 ix = _mm512_loadu_ps(inv_dir_x), iy = _mm512_loadu_ps(inv_dir_y), iz = _mm512_loadu_ps(inv_dir_z);
+		__m512 tx1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.min.x), ox), ix);
+		__m512 tx2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.max.x), ox), ix);
+		__m512 ty1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.min.y), oy), iy);
+		__m512 ty2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.max.y), oy), iy);
+		__m512 tz1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.min.z), oz), iz);
+		__m512 tz2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(box.max.z), oz), iz);
+		__m512 t0 = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(tx1, tx2), _mm512_min_ps(ty1, ty2)),
+			_mm512_max_ps(_mm512_min_ps(tz1, tz2), _mm512_setzero_ps()));
+		__m512 t1 = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(tx1, tx2), _mm512_max_ps(ty1, ty2)),
+			_mm512_min_ps(_mm512_max_ps(tz1, tz2), _mm512_loadu_ps(t_min)));
+		return static_cast<unsigned int>(_mm512_cmp_ps_mask(t0, t1, _CMP_LE_OQ));
+	}
+#endif
+};
+
+#endif
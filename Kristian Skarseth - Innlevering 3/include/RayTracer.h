@@ -5,11 +5,19 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <functional>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
+#include "SIMD.hpp"
 #include "FrameBuffer.hpp"
 #include "SceneObject.hpp"
 #include "RayTracerState.hpp"
+#include "RenderProgress.hpp"
+#include "ThreadPool.hpp"
+#include "TileOrder.hpp"
+#include "Cache.hpp"
 /**
 * Defines the virtual screen we project our rays through
 */
@@ -26,21 +34,15 @@ struct Screen{
 	float top;
 	float bottom;
 };
-struct ScreenCoord{
-	ScreenCoord(unsigned int x, unsigned int y){
-		this->x = x;
-		this->y = y;
-	}
-	ScreenCoord(){}
-	unsigned int x;
-	unsigned int y;
-};
 
-struct Thread{
-	std::shared_ptr<boost::thread> thread;
-	int thread_id;
-	float thread_progress;
-	float next_progress_target;
+/**
+  * How one frame rendered with one tile order, from RayTracer::profileTileOrders()
+  */
+struct TileOrderProfile {
+	tiles::Order order;
+	double seconds;
+	double l2_miss_rate;      //< L2 misses per L2 access, -1 if the cache counters are not available
+	double l2_misses_per_ray; //< -1 if the cache counters are not available
 };
 
 /**
@@ -49,6 +51,8 @@ struct Thread{
   */
 class RayTracer {
 public:
+	typedef std::function<void (const RenderProgress&)> ProgressCallback;
+
 	RayTracer(unsigned int width, unsigned int height);
 
 	/**
@@ -61,22 +65,148 @@ public:
 	*/
 	void addLightSource(std::shared_ptr<LightObject>& light);
 
+	/**
+	  * Sets the environment (cube map) seen by rays that miss the scene
+	  */
+	void setEnvironment(std::shared_ptr<Environment>& environment);
+
+	/**
+	  * Chooses the acceleration structure: accel::Grid for many evenly spread
+	  * objects of similar size, accel::Hierarchy for a BVH, or accel::Auto
+	  * (default) to pick the grid when the object sizes are uniform.
+	  */
+	void setAccelerator(accel::Type type);
+
+	/**
+	  * Chooses how the acceleration structure is built when rendering starts.
+	  * bvh::BuildQuality gives fast tracing, bvh::BuildSpeed the fastest startup
+	  * for very large scenes, and bvh::BuildSpatialSplits the fastest tracing for
+	  * scenes with large or long, thin primitives, at the cost of build time and memory.
+	  */
+	void setBVHBuildMode(bvh::BuildMode mode);
+
+	/**
+	  * Chooses the branching factor of the acceleration structure: 2, 4 (default) or 8.
+	  * The wide trees test all children of a node with one SIMD box test.
+	  */
+	void setBVHWidth(unsigned int width);
+
+	/**
+	  * Caches built acceleration structures as files in directory, so rendering
+	  * the same scene again maps the tree from disk instead of building it.
+	  * Off unless a directory is set.
+	  */
+	void setBVHCacheDirectory(std::string directory);
+
+	/**
+	  * Replaces the store that intersects the scene objects without virtual
+	  * calls. By default it holds Sphere, Triangle and Quad, a
+	  * PrimitiveStore over a longer type list adds more types.
+	  */
+	void setPrimitiveStore(std::shared_ptr<PrimitiveDispatch> store);
+
+	/**
+	  * Runs the box and sphere kernels at a lower SIMD level than the CPU
+	  * supports, such as simd::SSE to time it against simd::AVX on the same
+	  * machine. By default the widest supported level is used, or the one
+	  * named by the environment variable RAYTRACER_SIMD (scalar, sse, avx or
+	  * avx512). Levels the CPU lacks are lowered to the widest it has.
+	  */
+	void setSIMDLevel(simd::Level level);
+
+	/**
+	  * Sets the width and height in pixels of the square screen tiles that
+	  * threads render as one unit. Each tile is culled against the scene once,
+	  * so larger tiles cull less tightly, while smaller tiles cost more culling
+	  * and leave fewer pixels per steal. By default, or with size 0, the tiles
+	  * are sized when the scene is built so that the BVH nodes and texels
+	  * one tile reads fit in half of the L2 cache.
+	  */
+	void setTileSize(unsigned int size);
+
+	/**
+	  * Sets the order the tiles are handed out to the threads in, by default
+	  * tiles::Hilbert, so the tiles a thread renders in a row are neighbours
+	  */
+	void setTileOrder(tiles::Order order);
+
+	/**
+	  * Renders the frame once with every tile order and reports the time and,
+	  * where the hardware counters can be read, the L2 miss rate of each, to
+	  * pick the best order for a scene. An untimed frame is rendered first, so
+	  * every order is measured with the tile size fitted and warm caches. The
+	  * order set with setTileOrder() is kept. The frame buffer holds the frame
+	  * of the last order afterwards.
+	  */
+	std::vector<TileOrderProfile> profileTileOrders();
+
+	/**
+	  * Sets the number of threads that render, build the acceleration
+	  * structure and encode images, by default one per hardware thread. The
+	  * threads are started here and kept for all later work. With pin_threads
+	  * every thread but the calling one stays on a logical CPU of its own.
+	  * Must not be called while rendering.
+	  * @param count Threads to use, including the thread calling render(), or 0 for one per hardware thread
+	  */
+	void setThreadCount(unsigned int count, bool pin_threads = false);
+
+	/**
+	  * Call after moving objects between frames, before the next render().
+	  * Refits the acceleration structure, and rebuilds it only once its
+	  * quality has dropped too far.
+	  */
+	void refitScene();
+
 	/**
 	  * Renders the current scene
 	  */
 	void render();
 
+	/**
+	  * Makes render() progressive, for previews that must be ready by a
+	  * deadline. It then renders in passes that each trace one more sample of
+	  * every pixel, and after each pass the frame buffer holds the average of
+	  * the samples so far, a complete image that gets sharper with every pass.
+	  * The render stops after samples passes, or once the next pass is not
+	  * expected to finish within seconds of the start. The first pass is always
+	  * rendered. The budget is not a hard deadline: a pass is expected to take
+	  * as long as the last one, and a pass that has started is never stopped,
+	  * so a pass that is slower than the one before ends after the budget.
+	  * The passes sample a regular 8 by 8 grid over the pixel, so after 64
+	  * passes the image has as many samples as a full render, but not the
+	  * same ones.
+	  * @param seconds Wall clock budget of a render, 0 for no limit
+	  * @param samples Most samples per pixel, from 1 to 64
+	  * @throws std::runtime_error if samples is 0
+	  */
+	void setProgressive(bool progressive, double seconds = 0.0, unsigned int samples = 64);
+
+	/**
+	  * Calls callback every interval seconds while render() runs, from a
+	  * monitor thread of its own, and once from render() when the frame is
+	  * done. The callback must return quickly, as the next report waits for
+	  * it. By default the progress is printed every second. An empty callback
+	  * turns the reports off.
+	  */
+	void setProgressCallback(ProgressCallback callback, double interval = 1.0);
+
+	/**
+	  * Returns how far the current or last render has come. Can be called
+	  * from any thread at any time, also while render() runs, without
+	  * slowing the render down.
+	  */
+	RenderProgress getProgress() const;
+
 	/**
 	  * Saves the currently rendered frame as an image file
 	  */
 	void save(std::string basename, std::string extension);
 
-	void renderFrameArea(std::vector<ScreenCoord>* screen_coords, 
-						unsigned int start_index, unsigned int end_index,
-						std::shared_ptr<Thread> thread_info);
-
-	glm::vec3 raytrace_64x_multisampled(unsigned int i, unsigned int j);
-	glm::vec3 raytrace_16x_multisampled(unsigned int i, unsigned int j);
+	/**
+	  * @param entries If not NULL, the BVH subtrees culled for the tile holding the pixel
+	  */
+	glm::vec3 raytrace_64x_multisampled(unsigned int i, unsigned int j, const std::vector<unsigned int>* entries = NULL);
+	glm::vec3 raytrace_16x_multisampled(unsigned int i, unsigned int j, const std::vector<unsigned int>* entries = NULL);
 	glm::vec3 raytrace_4x_multisampled(unsigned int i, unsigned int j);
 	glm::vec3 raytrace_1x_sampled(unsigned int i, unsigned int j);
 
@@ -86,7 +216,84 @@ private:
 
 	Screen screen;
 
-	float lerp(int i0, int i1, float t);
+	std::shared_ptr<ThreadPool> pool;
+	std::shared_ptr<ProgressCounters> progress;
+	ProgressCallback progress_callback;
+	double progress_interval;
+	double render_start;      //< Time the current or last render started, from Timer::getCurrentTime()
+	unsigned long long render_pixels; //< Pixels in the current or last render
+	unsigned int render_samples;      //< Samples per pixel complete in the frame buffer
+	bool render_done;
+	mutable boost::mutex progress_mutex; //< Guards the render start and end, not the counters
+	boost::condition_variable render_finished;
+
+	/**
+	  * Reports the progress to the callback every progress_interval seconds
+	  * until render_done is set. Runs on a thread of its own.
+	  */
+	void monitorProgress();
+
+	/**
+	  * The default progress callback, which prints the progress
+	  */
+	static void printProgress(const RenderProgress& progress);
+
+	/**
+	  * Traces one ray per sample offset within pixel (i, j) and averages them
+	  * @param rays, colors Scratch buffers, kept by the caller so that a
+	  *        render does not allocate them again for every pixel
+	  */
+	glm::vec3 raytrace_samples(unsigned int i, unsigned int j, const glm::vec2* samples, std::size_t count,
+		const std::vector<unsigned int>* entries, std::vector<Ray>& rays, std::vector<glm::vec3>& colors);
+
+	/**
+	  * Returns the frustum of the primary rays through the pixels from (i0, j0)
+	  * up to but not including (i1, j1), widened by half a pixel on every side
+	  * beyond the sample offsets so no sample ray lies on its edge
+	  */
+	Frustum tileFrustum(unsigned int i0, unsigned int j0, unsigned int i1, unsigned int j1);
+
+	/**
+	  * Builds the acceleration structure, unless the scene is already frozen
+	  */
+	void freezeScene();
+
+	/**
+	  * Renders the tiles in order on the pool, each with all 64 samples per
+	  * pixel if pass is negative, or else adding sample pass of a progressive
+	  * render to the accumulated samples of every pixel
+	  */
+	void renderPass(const std::vector<unsigned int>& order, unsigned int tiles_x, unsigned int size, int pass);
+
+	/**
+	  * Returns the primary ray through pixel (i, j), offset within it
+	  */
+	Ray primaryRay(unsigned int i, unsigned int j, const glm::vec2& offset);
+
+	/**
+	  * Returns the offset within the pixel of the sample a progressive pass
+	  * traces, the centre of one cell of a regular progressive_grid_size by
+	  * progressive_grid_size grid over the pixel
+	  */
+	static glm::vec2 progressiveSample(unsigned int pass);
+
+	/**
+	  * Returns the largest tile size from 64 down to 8 pixels for which the BVH
+	  * nodes and environment texels the heaviest sampled tile reads fit in
+	  * half of the L2 cache. The rest is left to the objects in the leaves,
+	  * the stack and the frame buffer, and to the second thread of a core.
+	  */
+	unsigned int fitTileSize();
+
+	unsigned int tile_size;        //< Width and height in pixels of the screen tiles, 0 to fit them to the L2 cache
+	unsigned int fitted_tile_size; //< Tile size fitTileSize() found for the scene, 0 until then
+	tiles::Order tile_order;
+
+	static const unsigned int progressive_grid_size = 8;
+	bool progressive;
+	double progressive_seconds;
+	unsigned int progressive_samples;
+	std::vector<glm::vec3> accumulation; //< Sum of the samples of every pixel so far in a progressive render
 
 	static const glm::vec2 sample_16x_values[];
 	static const std::size_t sample_16x_array_length;
@@ -2,9 +2,19 @@
 #define _RAYTRACER_STATE_HPP__
 
 #include <memory>
+#include <limits>
+#include <string>
 
 #include <glm/glm.hpp>
 #include "SceneObject.hpp"
+#include "BVH.hpp"
+#include "WideBVH.hpp"
+#include "BVHCache.hpp"
+#include "Grid.hpp"
+#include "PrimitiveStore.hpp"
+#include "Frustum.hpp"
+#include "Environment.hpp"
+#include "ThreadPool.hpp"
 
 class LightObject;
 /**
@@ -15,9 +25,134 @@ class LightObject;
 class RayTracerState {
 public:
 	RayTracerState(glm::vec3 camera_position)
-		: camera_position(camera_position){
+		: camera_position(camera_position), accelerator(accel::Auto), use_grid(false),
+		  build_mode(bvh::BuildQuality), bvh_width(4),
+		  built_cost(0.0f), rebuild_threshold(1.5f), loaded_from_cache(false), frozen(false){
 	}
 	
+	/**
+	  * Adds an object to the scene. The acceleration structure is rebuilt the
+	  * next time the scene is frozen.
+	  */
+	inline void addSceneObject(std::shared_ptr<SceneObject>& o) {
+		scene.push_back(o);
+		frozen = false;
+	}
+
+	/**
+	  * Builds the acceleration structure over the current scene. Must be called
+	  * after the last object is added and before any rays are traced.
+	  * If a cache directory is set, a tree cached for this scene is loaded
+	  * instead, and a newly built tree is written to the cache.
+	  */
+	inline void freeze() {
+		if (frozen) return;
+		build(!cache_directory.empty());
+	}
+
+	/**
+	  * Updates the acceleration structure after objects have moved but none were
+	  * added or removed, as between the frames of an animation. The node bounds
+	  * are refitted in one linear pass, and the tree is only rebuilt when its
+	  * SAH cost has grown past rebuild_threshold times the cost after the last build.
+	  * Rebuilds during an animation are not cached, as each frame is a new scene.
+	  * @return true if the tree was rebuilt instead of refitted
+	  */
+	inline bool refit() {
+		if (!frozen) {
+			freeze();
+			return true;
+		}
+		if (use_grid) {
+			//Building a grid is about as cheap as refitting a tree
+			grid.build(bounded, pool.get());
+			return true;
+		}
+		bvh.refit();
+		if (bvh.sahCost() > built_cost*rebuild_threshold) {
+			build(false);
+			return true;
+		}
+		collapseWideBVH();
+		updatePrimitives();
+		return false;
+	}
+
+	/**
+	  * Sets the directory built acceleration structures are cached in. An empty
+	  * string, the default, turns the cache off.
+	  */
+	inline void setCacheDirectory(const std::string& directory) {
+		cache_directory = directory;
+	}
+
+	/**
+	  * Sets how much the SAH cost may grow through refits before refit() rebuilds
+	  */
+	inline void setRebuildThreshold(float threshold) {
+		rebuild_threshold = threshold;
+	}
+
+	/**
+	  * Selects the acceleration structure: a grid, a BVH, or by default a grid
+	  * only when UniformGrid::suits() the objects
+	  */
+	inline void setAccelerator(accel::Type type) {
+		if (type != accelerator) frozen = false;
+		accelerator = type;
+	}
+
+	/**
+	  * Selects between build quality and build speed for the acceleration structure
+	  */
+	inline void setBuildMode(bvh::BuildMode mode) {
+		if (mode != build_mode) frozen = false;
+		build_mode = mode;
+	}
+
+	/**
+	  * Sets the branching factor used for traversal: 2 walks the binary tree,
+	  * 4 and 8 collapse it into wide nodes tested with SIMD
+	  */
+	inline void setBVHWidth(unsigned int width) {
+		if (width != 4 && width != 8) width = 2;
+		if (width != bvh_width) frozen = false;
+		bvh_width = width;
+	}
+
+	/**
+	  * Sets the store that intersects the bounded objects with the primitive
+	  * tests bound at compile time, such as a PrimitiveStore over the built in
+	  * primitive types. Without one, every object is called through SceneObject.
+	  * Only used with a BVH, the grid always calls through SceneObject.
+	  */
+	inline void setPrimitiveStore(std::shared_ptr<PrimitiveDispatch>& store) {
+		primitives = store;
+		frozen = false;
+	}
+
+	/**
+	  * Sets what rays that miss every object see, such as a cube map
+	  */
+	inline void setEnvironment(std::shared_ptr<Environment>& environment) {
+		this->environment = environment;
+	}
+
+	/**
+	  * Sets the threads the grid and BVH are built on. Without a pool they are
+	  * built on OpenMP threads.
+	  */
+	inline void setThreadPool(std::shared_ptr<ThreadPool>& pool) {
+		this->pool = pool;
+	}
+
+	inline bool isFrozen() const { return frozen; }
+	inline bool isLoadedFromCache() const { return loaded_from_cache; }
+	inline bool isUsingGrid() const { return use_grid; }
+	inline const BVH& getBVH() const { return bvh; }
+	inline const UniformGrid& getGrid() const { return grid; }
+	inline const Environment* getEnvironment() const { return environment.get(); }
+
 	inline std::vector<std::shared_ptr<SceneObject> >& getScene() { return scene; }
 	inline std::vector<std::shared_ptr<LightObject> >& getLights(){ return lights; } 
 	inline glm::vec3 getCamPos() { return camera_position; }
@@ -29,45 +164,284 @@ public:
 	  * @return -1 if no intersection found, otherwise the object index in the scene
 	  */
 	inline glm::vec3 rayTrace(Ray& ray) {
+		return trace(ray, NULL);
+	}
+
+	/**
+	  * Finds the parts of the BVH that can be seen inside frustum, to pass to
+	  * rayTrace() along with rays that all lie inside it, such as the primary
+	  * rays of one screen tile. Must be called after freeze().
+	  * @return false if the scene can not be culled, as with the grid
+	  */
+	inline bool cull(const Frustum& frustum, std::vector<unsigned int>& entries) const {
+		if (use_grid) return false;
+		bvh.cull(frustum, entries);
+		return true;
+	}
+
+	/**
+	  * Traces count rays from one origin, such as the samples of one pixel, and
+	  * sets colors[k] to the color seen by rays[k]. The rays walk the binary BVH
+	  * in packets of 16, 8 or 4 that share the node tests, and are traced one at
+	  * a time with a grid, for the rays left over, and for packets whose rays
+	  * point into different octants.
+	  * @param entries If not NULL, the subtrees found by cull() for a frustum
+	  *        holding all the rays, and the only parts of the BVH they walk
+	  */
+	inline void rayTrace(Ray* rays, unsigned int count, glm::vec3* colors, const std::vector<unsigned int>* entries = NULL) {
+		unsigned int k = 0;
+		if (!use_grid) {
+			for (; k+16 <= count; k += 16) tracePacket<16>(rays+k, colors+k, entries);
+			for (; k+8 <= count; k += 8) tracePacket<8>(rays+k, colors+k, entries);
+			for (; k+4 <= count; k += 4) tracePacket<4>(rays+k, colors+k, entries);
+		}
+		for (; k<count; ++k) {
+			colors[k] = trace(rays[k], entries);
+		}
+	}
+
+	/**
+	  * Tests whether anything blocks ray before t_max, for shadow rays and other
+	  * visibility tests. Returns at the first blocker found, and never tests
+	  * objects that can not block light.
+	  * @param ray The ray to test, origin at the point to test from
+	  * @param t_max Ray parameter of the end of the segment, 1 if the direction spans it
+	  * @return true if some object intersects the ray between the origin and t_max
+	  */
+	inline bool occluded(const Ray& ray, float t_max) {
+		const float z_offset = 10e-4f;
+
+		for (unsigned int k=0; k<unbounded_occluders.size(); ++k) {
+			float t = unbounded_occluders[k]->intersect(ray);
+			if (t > z_offset && t < t_max) return true;
+		}
+		if (use_grid) return grid.occluded(ray, z_offset, t_max);
+		if (primitives) return primitives->occluded(ray, z_offset, t_max);
+		switch (bvh_width) {
+		case 4: return bvh4.occluded(ray, z_offset, t_max);
+		case 8: return bvh8.occluded(ray, z_offset, t_max);
+		default: return bvh.occluded(ray, z_offset, t_max);
+		}
+	}
 
+
+private:
+	std::vector<std::shared_ptr<SceneObject> > scene;
+	std::vector<std::shared_ptr<LightObject> > lights;
+	glm::vec3 camera_position;
+
+	/**
+	  * Traces one ray, through the BVH subtrees in entries if not NULL. Only
+	  * hits inside the interval of the ray are taken, and the ray is clipped
+	  * to the closest one.
+	  */
+	inline glm::vec3 trace(Ray& ray, const std::vector<unsigned int>* entries) {
 		if (!ray.isValid()) {
 			return glm::vec3(0.0f);
 		}
-		const float z_offset = 10e-4f;
+		const float z_offset = glm::max(10e-4f, ray.getMinT());
 
-		float t = -1;
-		float t_min = std::numeric_limits<float>::max();
-		int k_min=-1;
+		float t_min = ray.getMaxT();
+		SceneObject* hit = NULL;
+		unsigned int stored_hit = 0;
+		bool hit_stored = false;
 
-		
-		//Loop through all the objects, to find the closest intersection, if any
-		//This is essentially just ray-casting
-		for (unsigned int k=0; k<scene.size(); ++k) {
-			t = scene.at(k)->intersect(ray);
+		//Objects without a bounding box are tested against every ray,
+		//the rest are found by walking the hierarchy
+		intersectUnbounded(ray, z_offset, t_min, hit);
+		if (use_grid) grid.intersect(ray, z_offset, t_min, hit);
+		else if (entries) {
+			if (primitives) hit_stored = primitives->intersect(ray, z_offset, t_min, stored_hit, entries->data(), entryCount(entries));
+			else bvh.intersect(ray, z_offset, t_min, hit, entries->data(), entryCount(entries));
+		}
+		else if (primitives) hit_stored = primitives->intersect(ray, z_offset, t_min, stored_hit);
+		else switch (bvh_width) {
+		case 4: bvh4.intersect(ray, z_offset, t_min, hit); break;
+		case 8: bvh8.intersect(ray, z_offset, t_min, hit); break;
+		default: bvh.intersect(ray, z_offset, t_min, hit); break;
+		}
+
+		return shade(ray, t_min, hit, hit_stored, stored_hit);
+	}
+
+	static inline unsigned int entryCount(const std::vector<unsigned int>* entries) {
+		return static_cast<unsigned int>(entries->size());
+	}
+
+	inline void intersectUnbounded(const Ray& ray, float t_near, float& t_min, SceneObject*& hit) {
+		for (unsigned int k=0; k<unbounded.size(); ++k) {
+			float t = unbounded[k]->intersect(ray);
 
-			if (t > z_offset && t <= t_min) {
-				k_min = k;
+			if (t > t_near && t <= t_min) {
+				hit = unbounded[k];
 				t_min = t;
 			}
 		}
+	}
 
-		if (k_min >= 0) {
-			
-			return scene.at(k_min)->rayTrace(ray, t_min, *this);
+	/**
+	  * Colors the closest hit of ray: an object hit at t_min, a primitive of the
+	  * store if hit_stored, or the environment if nothing was hit
+	  */
+	inline glm::vec3 shade(Ray& ray, float t_min, SceneObject* hit, bool hit_stored, unsigned int stored_hit) {
+		ray.clip(t_min);
+		HitRecord record;
+		record.t = t_min;
+		if (hit_stored) {
+			return primitives->rayTrace(stored_hit, ray, record, *this);
+		}
+		else if (hit != NULL) {
+			hit->computeHit(ray, record);
+			return hit->rayTrace(ray, record, *this);
+		}
+		else if (environment) {
+			//The ray left the scene, so it sees the environment
+			return environment->rayTrace(ray);
 		}
 		else {
-			//This should not be able to happen since we have a cubemap,
-			//but it's there just in case anyway. At least we'll see black pixels
-			//if it happens.
+			//No environment set, so rays that miss everything are black
 			return glm::vec3(0); 
 		}
 	}
 
+	template <unsigned int Size>
+	inline void tracePacket(Ray* rays, glm::vec3* colors, const std::vector<unsigned int>* entries) {
+		const float z_offset = 10e-4f;
 
-private:
-	std::vector<std::shared_ptr<SceneObject> > scene;
-	std::vector<std::shared_ptr<LightObject> > lights;
-	glm::vec3 camera_position;
+		//The packet traversal takes one t_near for all rays, so rays whose
+		//interval starts further out are traced alone
+		bool coherent = true;
+		for (unsigned int k=0; k<Size; ++k) {
+			if (rays[k].getMinT() > z_offset) coherent = false;
+		}
+
+		RayPacket<Size> packet(rays);
+		if (!coherent || !packet.isCoherent()) {
+			for (unsigned int k=0; k<Size; ++k) {
+				colors[k] = trace(rays[k], entries);
+			}
+			return;
+		}
+
+		SceneObject* hits[Size];
+		for (unsigned int k=0; k<Size; ++k) {
+			hits[k] = NULL;
+			if (!rays[k].isValid()) packet.active &= ~(1u << k);
+			else intersectUnbounded(rays[k], z_offset, packet.t_min[k], hits[k]);
+		}
+
+		unsigned int stored = 0;
+		if (primitives) {
+			if (entries) stored = primitives->intersect(packet, z_offset, entries->data(), entryCount(entries));
+			else stored = primitives->intersect(packet, z_offset);
+		}
+		else {
+			unsigned int found = entries ? bvh.intersect(packet, z_offset, entries->data(), entryCount(entries))
+				: bvh.intersect(packet, z_offset);
+			for (unsigned int k=0; k<Size; ++k) {
+				if (found & (1u << k)) hits[k] = bvh.getObject(packet.hit[k]);
+			}
+		}
+
+		for (unsigned int k=0; k<Size; ++k) {
+			if (packet.active & (1u << k)) {
+				colors[k] = shade(rays[k], packet.t_min[k], hits[k], (stored & (1u << k)) != 0, packet.hit[k]);
+			}
+			else {
+				colors[k] = glm::vec3(0.0f);
+			}
+		}
+	}
+
+	/**
+	  * Splits the scene into objects with and without bounds and builds, or
+	  * loads from the cache, the acceleration structure over the bounded ones
+	  */
+	inline void build(bool use_cache) {
+		bounded.clear();
+		unbounded.clear();
+		unbounded_occluders.clear();
+		for (unsigned int k=0; k<scene.size(); ++k) {
+			if (scene.at(k)->getBoundingBox().isInfinite()) {
+				unbounded.push_back(scene.at(k).get());
+				if (scene.at(k)->isOccluder()) {
+					unbounded_occluders.push_back(scene.at(k).get());
+				}
+			}
+			else {
+				bounded.push_back(scene.at(k));
+			}
+		}
+
+		loaded_from_cache = false;
+		use_grid = accelerator == accel::Grid || (accelerator == accel::Auto && UniformGrid::suits(bounded));
+		if (use_grid) {
+			bvh.clear();
+			collapseWideBVH();
+			grid.build(bounded, pool.get());
+			built_cost = 0.0f;
+			frozen = true;
+			return;
+		}
+		grid.clear();
+
+		if (use_cache) {
+			unsigned long long hash = BVHCache::hashScene(bounded, build_mode);
+			std::string file = BVHCache::filename(cache_directory, hash);
+			loaded_from_cache = BVHCache::load(file, hash, bounded, bvh_width, bvh, bvh4, bvh8);
+			if (!loaded_from_cache) {
+				bvh.build(bounded, build_mode, pool.get());
+				collapseWideBVH();
+				BVHCache::save(file, hash, bvh_width, bvh, bvh4, bvh8);
+			}
+			else if ((bvh_width == 4 && bvh4.empty()) || (bvh_width == 8 && bvh8.empty())) {
+				//Cached with another width, the wide tree is cheap to collapse again
+				collapseWideBVH();
+			}
+		}
+		else {
+			bvh.build(bounded, build_mode, pool.get());
+			collapseWideBVH();
+		}
+		built_cost = bvh.sahCost();
+		updatePrimitives();
+		frozen = true;
+	}
+
+	/**
+	  * The wide trees are collapsed from the binary one, which is linear in the
+	  * number of nodes, so they are simply remade after a refit
+	  */
+	inline void collapseWideBVH() {
+		bvh4.clear();
+		bvh8.clear();
+		if (bvh_width == 4) bvh4.build(bvh);
+		else if (bvh_width == 8) bvh8.build(bvh);
+	}
+
+	inline void updatePrimitives() {
+		if (primitives) primitives->update(bounded, bvh, bvh4, bvh8);
+	}
+
+	std::vector<std::shared_ptr<SceneObject> > bounded; //< Kept so refit() can rebuild the grid and update the primitive store
+	accel::Type accelerator;
+	bool use_grid;
+	UniformGrid grid;
+	BVH bvh;
+	WideBVH<4> bvh4;
+	WideBVH<8> bvh8;
+	bvh::BuildMode build_mode;
+	unsigned int bvh_width;
+	float built_cost;
+	float rebuild_threshold;
+	std::string cache_directory;
+	bool loaded_from_cache;
+	std::vector<SceneObject*> unbounded;
+	std::vector<SceneObject*> unbounded_occluders;
+	std::shared_ptr<PrimitiveDispatch> primitives;
+	std::shared_ptr<Environment> environment;
+	std::shared_ptr<ThreadPool> pool;
+	bool frozen;
 };
 
 #endif
\ No newline at end of file
@@ -19,8 +19,8 @@ public:
 		  absorb_amount(0.05f){
 	}
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
-		return state.rayTrace(ray.spawn(t, glm::reflect(ray.getDirection(), normal), ray.getColorContribution() - absorb_amount));
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return state.rayTrace(ray.spawn(hit.position, glm::reflect(ray.getDirection(), hit.normal), ray.getColorContribution() - absorb_amount));
 	}
 
 
@@ -19,12 +19,12 @@ public:
 		  absorb_amount(0.05f){
 	}
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
-		float dotval = glm::dot(normal, -ray.getDirection());
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		float dotval = glm::dot(hit.normal, -ray.getDirection());
 		float s = 0.7f;
 		dotval = s*1.0f + (1.0f-s) * dotval;
 
-		return state.rayTrace(ray.spawn(t, glm::reflect(ray.getDirection(), normal), ray.getColorContribution() - absorb_amount)) * dotval;
+		return state.rayTrace(ray.spawn(hit.position, glm::reflect(ray.getDirection(), hit.normal), ray.getColorContribution() - absorb_amount)) * dotval;
 	}
 
 
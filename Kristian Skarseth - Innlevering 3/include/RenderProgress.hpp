@@ -0,0 +1,91 @@
+#ifndef _RENDERPROGRESS_HPP__
+#define _RENDERPROGRESS_HPP__
+
+#include <boost/atomic.hpp>
+
+#include "CacheLineArray.hpp"
+
+/**
+  * How far a render has come, as handed to progress callbacks and returned
+  * by RayTracer::getProgress()
+  */
+struct RenderProgress {
+	RenderProgress() : pixels_done(0), pixel_count(0), rays_traced(0),
+		samples_per_pixel(0), elapsed(0.0), rays_per_second(0.0), eta(-1.0), finished(false) {}
+
+	/**
+	  * Returns the share of the pixels that are done, from 0 to 1
+	  */
+	inline double getFraction() const {
+		return (pixel_count == 0) ? 0.0 : pixels_done/static_cast<double>(pixel_count);
+	}
+
+	unsigned long long pixels_done;
+	unsigned long long pixel_count; //< Pixels in the frame, times the passes of a progressive render
+	unsigned long long rays_traced; //< Primary rays, one per sample
+	unsigned int samples_per_pixel; //< Samples in every pixel so far, one per complete progressive pass
+	double elapsed;                 //< Seconds since the render started
+	double rays_per_second;         //< Primary rays per second so far
+	double eta;                     //< Seconds left at the rate so far, -1 until a pixel is done
+	bool finished;
+};
+
+/**
+  * Counts the pixels and rays done by every render thread, each in a counter
+  * of its own. Only the thread itself writes its counter, and the counters
+  * are padded to a cache line and kept in a CacheLineArray so each has a line
+  * of its own, so counting costs the render threads no shared writes.
+  * Any other thread can sum the counters at any time while they are counted,
+  * and sees a count that is at most a pixel per thread behind.
+  */
+class ProgressCounters {
+public:
+	ProgressCounters(unsigned int thread_count)
+		: thread_count(thread_count), counters(thread_count) {}
+
+	inline unsigned int getThreadCount() const { return thread_count; }
+
+	/**
+	  * Sets all counters to zero. Must not be called while threads count.
+	  */
+	inline void reset() {
+		for (unsigned int t=0; t<thread_count; ++t) {
+			counters[t].pixels.store(0);
+			counters[t].rays.store(0);
+		}
+	}
+
+	/**
+	  * Counts pixels and rays done by thread. Must only be called by that thread.
+	  */
+	inline void add(unsigned int thread, unsigned long long pixels, unsigned long long rays) {
+		Counter& counter = counters[thread];
+		counter.pixels.store(counter.pixels.load(boost::memory_order_relaxed) + pixels, boost::memory_order_relaxed);
+		counter.rays.store(counter.rays.load(boost::memory_order_relaxed) + rays, boost::memory_order_relaxed);
+	}
+
+	/**
+	  * Sums the counts of all threads
+	  */
+	inline void sum(unsigned long long& pixels, unsigned long long& rays) const {
+		pixels = 0;
+		rays = 0;
+		for (unsigned int t=0; t<thread_count; ++t) {
+			pixels += counters[t].pixels.load(boost::memory_order_relaxed);
+			rays += counters[t].rays.load(boost::memory_order_relaxed);
+		}
+	}
+
+private:
+	struct Counter {
+		Counter() : pixels(0), rays(0) {}
+		boost::atomic<unsigned long long> pixels;
+		boost::atomic<unsigned long long> rays;
+		char padding[64 - 2*sizeof(boost::atomic<unsigned long long>)];
+	};
+
+	unsigned int thread_count;
+	CacheLineArray<Counter> counters;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef _SIMD_HPP__
+#define _SIMD_HPP__
+
+#include <cstring>
+
+/**
+  * Detects which SIMD instruction sets kernels can be compiled for, and
+  * includes the matching intrinsics headers. RAYTRACER_SSE is set for SSE2
+  * and up (always true on x64 and on x86 with /arch:SSE2). RAYTRACER_AVX and
+  * RAYTRACER_AVX512 are set when the compiler can emit AVX and AVX-512 for
+  * single functions, which are marked RAYTRACER_TARGET_AVX and
+  * RAYTRACER_TARGET_AVX512, without the rest of the program needing them. So
+  * one binary holds all the kernels, and simd::level() picks the widest the
+  * running CPU supports. Code using these must keep a scalar path for when
+  * none is set. Loads are unaligned, since std::vector does not promise more
+  * than the default alignment.
+  */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(RAYTRACER_SSE) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#include <immintrin.h>
+#include <cpuid.h>
+#define RAYTRACER_AVX 1
+#define RAYTRACER_TARGET_AVX __attribute__((target("avx")))
+#if defined(__clang__) || __GNUC__ >= 7
+#define RAYTRACER_AVX512 1
+#define RAYTRACER_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#elif defined(RAYTRACER_SSE) && defined(_MSC_VER)
+//MSVC emits any intrinsic regardless of /arch. The AVX intrinsics and
+//_xgetbv came with VS2010 SP1, and the AVX-512 ones with VS2017 15.3
+#include <intrin.h>
+#include <immintrin.h>
+#if _MSC_FULL_VER >= 160040219
+#define RAYTRACER_AVX 1
+#define RAYTRACER_TARGET_AVX
+#endif
+#if _MSC_VER >= 1911
+#define RAYTRACER_AVX512 1
+#define RAYTRACER_TARGET_AVX512
+#endif
+#endif
+
+namespace simd {
+	/**
+	  * The kernel sets, from narrowest to widest
+	  */
+	enum Level {
+		Scalar,
+		SSE,    //< 4 wide, SSE2
+		AVX,    //< 8 wide
+		AVX512  //< 16 wide, AVX-512F
+	};
+
+	inline const char* name(Level level) {
+		switch (level) {
+		case SSE: return "SSE2";
+		case AVX: return "AVX";
+		case AVX512: return "AVX-512";
+		default: return "scalar";
+		}
+	}
+
+	/**
+	  * Reads a level from its name as given by name(), or in lower case
+	  * @return false if text names no level
+	  */
+	inline bool parse(const char* text, Level& level) {
+		static const char* const names[] = { "scalar", "sse", "avx", "avx512" };
+		for (int k=AVX512; k>=Scalar; --k) {
+			if (std::strcmp(text, names[k]) == 0 || std::strcmp(text, name(static_cast<Level>(k))) == 0) {
+				level = static_cast<Level>(k);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	namespace detail {
+#if defined(RAYTRACER_SSE)
+		inline void cpuid(unsigned int leaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+			int r[4];
+			__cpuidex(r, static_cast<int>(leaf), 0);
+			for (int k=0; k<4; ++k) regs[k] = static_cast<unsigned int>(r[k]);
+#else
+			__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		/**
+		  * The register states the OS saves on context switches
+		  */
+		inline unsigned long long xgetbv() {
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned int eax, edx;
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+		}
+#endif
+
+		inline Level detect() {
+			Level level = Scalar;
+#if defined(RAYTRACER_SSE)
+			level = SSE;
+#if defined(RAYTRACER_AVX)
+			unsigned int regs[4];
+			cpuid(0, regs);
+			const unsigned int max_leaf = regs[0];
+			cpuid(1, regs);
+			const bool osxsave = (regs[2] & (1u << 27)) != 0;
+			const bool avx = (regs[2] & (1u << 28)) != 0;
+			if (!osxsave || !avx) return level;
+			//The OS must also save the ymm registers, and the zmm ones for AVX-512
+			const unsigned long long xcr0 = xgetbv();
+			if ((xcr0 & 0x6) != 0x6) return level;
+			level = AVX;
+#if defined(RAYTRACER_AVX512)
+			if (max_leaf < 7 || (xcr0 & 0xE6) != 0xE6) return level;
+			cpuid(7, regs);
+			if (regs[1] & (1u << 16)) level = AVX512;
+#else
+			(void) max_leaf;
+#endif
+#endif
+#endif
+			return level;
+		}
+	}
+
+	/**
+	  * Returns the widest level that is compiled in and that both the CPU and
+	  * the OS support
+	  */
+	inline Level supported() {
+		static const Level level = detail::detect();
+		return level;
+	}
+
+	namespace detail {
+		inline Level& selected() {
+			static Level level = supported();
+			return level;
+		}
+	}
+
+	/**
+	  * Returns the level the kernels run at, which is supported() unless
+	  * lowered with setLevel(). Kernels read it once per ray or packet.
+	  */
+	inline Level level() {
+		return detail::selected();
+	}
+
+	/**
+	  * Runs the kernels at level, such as to time one tier against another.
+	  * Levels above supported() are lowered to it. Must not be called while
+	  * rendering.
+	  * @return The level now used
+	  */
+	inline Level setLevel(Level level) {
+		detail::selected() = (level < supported()) ? level : supported();
+		return detail::selected();
+	}
+}
+
+#endif
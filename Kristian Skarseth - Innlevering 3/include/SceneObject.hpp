@@ -7,6 +7,8 @@
 #include <glm/glm.hpp>
 
 #include "Ray.hpp"
+#include "AABB.hpp"
+#include "HitRecord.hpp"
 
 
 class RayTracerState;
@@ -28,12 +30,52 @@ public:
 
 	/**
 	  * Performs recursive raytracing of the elements in scene
-	  * @param scene All elements in the scene
-	  * @param r The incoming ray to trace
-	  * @param color The color to set
-	  * @param depth The recursion depth of this tracing
+	  * @param ray The incoming ray to trace
+	  * @param hit The closest hit of ray, as filled in by computeHit
+	  * @param state The scene, for tracing further rays
 	  */
-	virtual glm::vec3 rayTrace(Ray &ray, const float& t, RayTracerState& state) = 0;
+	virtual glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) = 0;
+
+	/**
+	  * Fills in the hit record for the closest intersection of r, found by
+	  * intersect at hit.t. Only called for the object that was hit, once per ray.
+	  * The default only fills in the position.
+	  */
+	virtual void computeHit(const Ray& r, HitRecord& hit) { hit.position = r.getOrigin() + hit.t*r.getDirection(); }
+
+	/**
+	  * Returns the axis aligned box enclosing the object, used to place it in the
+	  * acceleration structure. Objects that can not be bounded (an infinite plane)
+	  * return AABB::infinite() and are tested against every ray instead.
+	  */
+	virtual AABB getBoundingBox() { return AABB::infinite(); }
+
+	/**
+	  * Returns the box around the part of the object that lies inside box, used
+	  * by builders that split large objects between several leaves. The default
+	  * is the overlap of box and the object's bounding box.
+	  */
+	virtual AABB getClippedBoundingBox(const AABB& box) { return getBoundingBox().intersection(box); }
+
+	/**
+	  * Most numbers getClipShape() writes
+	  */
+	static const unsigned int max_clip_shape_values = 12;
+
+	/**
+	  * Writes the numbers besides the bounding box that getClippedBoundingBox()
+	  * depends on, such as the corners of a triangle, so a tree built with
+	  * spatial splits is only reused from the cache for the same shapes. Writes
+	  * at most max_clip_shape_values numbers and returns how many. The default,
+	  * for objects clipped as their bounding box, writes none.
+	  */
+	virtual unsigned int getClipShape(float* values) { return 0; }
+
+	/**
+	  * Whether the object can block light. Objects that return false are left
+	  * out of shadow ray tests entirely.
+	  */
+	virtual bool isOccluder() { return true; }
 
 protected:
 	std::shared_ptr<SceneObjectEffect> effect;
@@ -2,6 +2,7 @@
 #define SCENEOBJECTEFFECT_HPP__
 
 #include "Ray.hpp"
+#include "HitRecord.hpp"
 #include "RayTracerState.hpp"
 #include "Light.hpp"
 
@@ -13,8 +14,9 @@ public:
 	/**
 	  * This function "shades" an intersection point between a scene object
 	  * and a ray. It can also fire new rays etc.
+	  * @param hit The hit point, normal and primitive, filled in by the object
 	  */
-	virtual glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) = 0;
+	virtual glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) = 0;
 private:
 };
 
@@ -17,11 +17,11 @@
 class ShadedPhongEffect : public SceneObjectEffect {
 public:
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, const glm::vec3& normal, RayTracerState& state) {
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
 		std::vector<std::shared_ptr<LightObject>>::iterator iter;
 		glm::vec3 color;
 
-		glm::vec3 p = ray.getOrigin() + t*ray.getDirection();
+		const glm::vec3& p = hit.position;
 
 		for(iter = state.getLights().begin(); iter != state.getLights().end(); iter++){
 			float shadow_value;
@@ -38,7 +38,7 @@ public:
 			glm::vec3 v = glm::normalize(ray.getOrigin() - p);
 			glm::vec3 l = glm::normalize(pos - p);
 			glm::vec3 h = glm::normalize(v+l);
-			glm::vec3 n = glm::normalize(normal);
+			const glm::vec3& n = hit.normal;
 
 			float diffuse = glm::max(0.0f, glm::dot(n, l));
 			float specular = glm::pow( glm::max(0.0f, glm::dot(n, h)), 50.0f);
@@ -77,18 +77,30 @@ public:
 	//}	
 
 	/**
-	* Computes normal for an intersection point on a sphere
+	* Computes the hit point and normal for an intersection point on a sphere
 	*/
-	const glm::vec3 computeNormal(const Ray& r, const float& t) {
-		return glm::vec3( ( (r.getOrigin() + t*r.getDirection()) - this->p) / this->r);
+	void computeHit(const Ray& r, HitRecord& hit) {
+		hit.position = r.getOrigin() + hit.t*r.getDirection();
+		hit.normal = (hit.position - this->p) / this->r;
 	}
 
-	glm::vec3 rayTrace(Ray &ray, const float& t, RayTracerState& state) {
-		glm::vec3 normal = computeNormal(ray, t);
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return effect->rayTrace(ray, hit, state);
+	}
+
+	AABB getBoundingBox() {
+		return AABB(p-glm::vec3(r), p+glm::vec3(r));
+	}
 
-		return effect->rayTrace(ray, t, normal, state);
+	/**
+	  * Moves the sphere, for animation. The scene must be refitted afterwards.
+	  */
+	void setCenter(glm::vec3 center) {
+		p = center;
 	}
 
+	inline const glm::vec3& getCenter() const { return p; }
+
 protected:
 	glm::vec3 p; //< center of sphere
 	float r;   //< sphere radius
@@ -0,0 +1,367 @@
+#ifndef _SPHERESET_HPP__
+#define _SPHERESET_HPP__
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cfloat>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+
+#include "RayTracerState.hpp"
+#include "SceneObject.hpp"
+#include "SceneObjectEffect.hpp"
+#include "SIMD.hpp"
+#include "BVH.hpp"
+
+/**
+  * Many spheres sharing one effect, stored as one scene object. Centres and
+  * squared radii are kept as separate x, y, z and r^2 arrays, in clusters of
+  * cluster_size neighbouring spheres, so one ray is tested against a whole
+  * cluster with 16 (AVX-512), 8 (AVX) or 4 (SSE) spheres per instruction. A
+  * BVH over the clusters picks the clusters a ray has to test.
+  *
+  * Spheres are grouped by the order of the leaves of a linear BVH over them,
+  * which follows a Morton curve, so the spheres of a cluster lie close together.
+  * The last cluster is padded with spheres that can never be hit.
+  */
+class SphereSet : public SceneObject {
+public:
+	/**
+	  * @param centers Centre of each sphere
+	  * @param radii Radius of each sphere
+	  * @throws std::runtime_error if there is not one radius per centre
+	  */
+	SphereSet(const std::vector<glm::vec3>& centers, const std::vector<float>& radii,
+		std::shared_ptr<SceneObjectEffect> effect)
+		: SceneObject(effect), sphere_count(static_cast<unsigned int>(centers.size()))
+	{
+		if (radii.size() != centers.size()) {
+			throw std::runtime_error("SphereSet needs one radius per centre");
+		}
+		build(centers, radii);
+	}
+
+	float intersect(const Ray& r) {
+		const float z_offset = glm::max(10e-4f, r.getMinT());
+		float t_min = r.getMaxT();
+		unsigned int cluster;
+		if (bvh.intersect(r, z_offset, t_min, cluster, Clusters(*this, r, z_offset))) {
+			return t_min;
+		}
+		return -1.0f;
+	}
+
+	/**
+	  * The hit sphere is not passed on from intersect, so the clusters are
+	  * walked once more to find it. The sphere is reported as its position in
+	  * the arrays given to the constructor.
+	  */
+	void computeHit(const Ray& r, HitRecord& hit) {
+		const float z_offset = glm::max(10e-4f, r.getMinT());
+		float t_min = std::numeric_limits<float>::max();
+		unsigned int cluster;
+		Clusters clusters(*this, r, z_offset);
+		hit.position = r.getOrigin() + hit.t*r.getDirection();
+		if (!bvh.intersect(r, z_offset, t_min, cluster, clusters)) {
+			return;
+		}
+		unsigned int lane;
+		intersectCluster(cluster, clusters, &lane);
+		const unsigned int i = cluster*cluster_size + lane;
+		hit.primitive = ids[i];
+		hit.normal = glm::normalize(hit.position - glm::vec3(cx[i], cy[i], cz[i]));
+	}
+
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return effect->rayTrace(ray, hit, state);
+	}
+
+	AABB getBoundingBox() {
+		return bounds;
+	}
+
+	inline unsigned int getSphereCount() const { return sphere_count; }
+	inline unsigned int getClusterCount() const { return static_cast<unsigned int>(cx.size()/cluster_size); }
+
+private:
+	static const unsigned int cluster_size = 16;
+
+	/**
+	  * The parts of the ray the cluster test needs, set up once per ray, which
+	  * also lets the BVH traversal intersect the clusters
+	  */
+	struct Clusters {
+		Clusters(const SphereSet& set, const Ray& r, float t_near)
+			: set(set), origin(r.getOrigin()), dir(r.getDirection()), t_near(t_near), level(simd::level()) {
+			a = glm::dot(dir, dir);
+			inv_a = 1.0f/a;
+		}
+		inline float intersect(unsigned int cluster, const Ray&) const { return set.intersectCluster(cluster, *this, NULL); }
+		const SphereSet& set;
+		glm::vec3 origin;
+		glm::vec3 dir;
+		float a;
+		float inv_a;
+		float t_near;
+		simd::Level level;
+	};
+
+	/**
+	  * Orders the spheres along the leaves of a linear BVH, packs them into
+	  * clusters, and builds the BVH over the clusters
+	  */
+	void build(const std::vector<glm::vec3>& centers, const std::vector<float>& radii) {
+		std::vector<AABB> boxes(sphere_count);
+		for (unsigned int i=0; i<sphere_count; ++i) {
+			glm::vec3 r(radii[i]);
+			boxes[i].extend(centers[i]-r);
+			boxes[i].extend(centers[i]+r);
+			bounds.extend(boxes[i]);
+		}
+		BVH order;
+		order.build(boxes, bvh::BuildSpeed);
+		const unsigned int* sorted = order.getIndexData();
+
+		//Padding spheres have r^2 = -FLT_MAX, so their discriminant is never positive
+		const unsigned int cluster_count = (sphere_count + cluster_size-1)/cluster_size;
+		std::vector<float> px(cluster_count*cluster_size, 0.0f), py(px), pz(px);
+		std::vector<float> pr2(cluster_count*cluster_size, -FLT_MAX);
+		std::vector<unsigned int> pid(cluster_count*cluster_size, 0);
+		std::vector<AABB> cluster_boxes(cluster_count);
+		for (unsigned int i=0; i<sphere_count; ++i) {
+			unsigned int sphere = sorted[i];
+			px[i] = centers[sphere].x;
+			py[i] = centers[sphere].y;
+			pz[i] = centers[sphere].z;
+			pr2[i] = radii[sphere]*radii[sphere];
+			pid[i] = sphere;
+			cluster_boxes[i/cluster_size].extend(boxes[sphere]);
+		}
+		bvh.build(cluster_boxes);
+
+		//Store the clusters in the leaf order of their BVH as well
+		const unsigned int* cluster_order = bvh.getIndexData();
+		cx.resize(px.size());
+		cy.resize(px.size());
+		cz.resize(px.size());
+		radius2.resize(px.size());
+		ids.resize(px.size());
+		for (unsigned int c=0; c<cluster_count; ++c) {
+			const unsigned int from = cluster_order[c]*cluster_size;
+			for (unsigned int k=0; k<cluster_size; ++k) {
+				cx[c*cluster_size+k] = px[from+k];
+				cy[c*cluster_size+k] = py[from+k];
+				cz[c*cluster_size+k] = pz[from+k];
+				radius2[c*cluster_size+k] = pr2[from+k];
+				ids[c*cluster_size+k] = pid[from+k];
+			}
+		}
+		bvh.useLeafOrder();
+	}
+
+	/**
+	  * Intersects the ray with every sphere of a cluster. With the centre
+	  * relative to the ray origin as oc, a sphere is hit at
+	  * t = (b -+ sqrt(b^2 - a*c))/a, where a = d.d, b = d.oc and c = oc.oc - r^2.
+	  * The near root is used unless it lies before t_near (the origin is inside
+	  * the sphere), as in Sphere::intersect.
+	  * @param lane Set to the sphere of the cluster that was hit, if not NULL
+	  * @return the closest hit beyond t_near, or -1 if there is none
+	  */
+	inline float intersectCluster(unsigned int cluster, const Clusters& q, unsigned int* lane) const {
+#if defined(RAYTRACER_AVX512)
+		if (q.level >= simd::AVX512) return intersectClusterAVX512(cluster, q, lane);
+#endif
+#if defined(RAYTRACER_AVX)
+		if (q.level >= simd::AVX) return intersectClusterAVX(cluster, q, lane);
+#endif
+#if defined(RAYTRACER_SSE)
+		if (q.level >= simd::SSE) return intersectClusterSSE(cluster, q, lane);
+#endif
+		const unsigned int first = cluster*cluster_size;
+		const float* px = &cx[first];
+		const float* py = &cy[first];
+		const float* pz = &cz[first];
+		const float* pr2 = &radius2[first];
+		const float infinity = std::numeric_limits<float>::infinity();
+
+		float t_min = infinity;
+		for (unsigned int k=0; k<cluster_size; ++k) {
+			glm::vec3 oc = glm::vec3(px[k], py[k], pz[k]) - q.origin;
+			float b = glm::dot(q.dir, oc);
+			float disc = b*b - q.a*(glm::dot(oc, oc) - pr2[k]);
+			if (disc < 0.0f) continue;
+			float s = std::sqrt(disc);
+			float t = (b - s)*q.inv_a;
+			if (t <= q.t_near) t = (b + s)*q.inv_a;
+			if (t > q.t_near && t < t_min) {
+				t_min = t;
+				if (lane != NULL) *lane = k;
+			}
+		}
+		return (t_min == infinity) ? -1.0f : t_min;
+	}
+
+#if defined(RAYTRACER_AVX512)
+	RAYTRACER_TARGET_AVX512 float intersectClusterAVX512(unsigned int cluster, const Clusters& q, unsigned int* lane) const {
+		const unsigned int first = cluster*cluster_size;
+		const float* px = &cx[first];
+		const float* py = &cy[first];
+		const float* pz = &cz[first];
+		const float* pr2 = &radius2[first];
+		const float infinity = std::numeric_limits<float>::infinity();
+
+		const __m512 ox = _mm512_set1_ps(q.origin.x), oy = _mm512_set1_ps(q.origin.y), oz = _mm512_set1_ps(q.origin.z);
+		const __m512 dx = _mm512_set1_ps(q.dir.x), dy = _mm512_set1_ps(q.dir.y), dz = _mm512_set1_ps(q.dir.z);
+		const __m512 a = _mm512_set1_ps(q.a), inv_a = _mm512_set1_ps(q.inv_a), t_near = _mm512_set1_ps(q.t_near);
+		const __m512 zero = _mm512_setzero_ps();
+		__m512 ocx = _mm512_sub_ps(_mm512_loadu_ps(px), ox);
+		__m512 ocy = _mm512_sub_ps(_mm512_loadu_ps(py), oy);
+		__m512 ocz = _mm512_sub_ps(_mm512_loadu_ps(pz), oz);
+		__m512 b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+		__m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)),
+			_mm512_loadu_ps(pr2));
+		__m512 disc = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(a, c));
+		__mmask16 hit = _mm512_cmp_ps_mask(disc, zero, _CMP_GE_OQ);
+		if (hit == 0) return -1.0f;
+		__m512 s = _mm512_sqrt_ps(_mm512_max_ps(disc, zero));
+		__m512 t_close = _mm512_mul_ps(_mm512_sub_ps(b, s), inv_a);
+		__m512 t_far = _mm512_mul_ps(_mm512_add_ps(b, s), inv_a);
+		__m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t_close, t_near, _CMP_GT_OQ), t_far, t_close);
+		hit &= _mm512_cmp_ps_mask(t, t_near, _CMP_GT_OQ);
+		if (hit == 0) return -1.0f;
+		t = _mm512_mask_blend_ps(hit, _mm512_set1_ps(infinity), t);
+		float t_min = _mm512_reduce_min_ps(t);
+		if (lane != NULL) {
+			*lane = firstLane(_mm512_cmp_ps_mask(t, _mm512_set1_ps(t_min), _CMP_EQ_OQ));
+		}
+		return t_min;
+	}
+#endif
+
+#if defined(RAYTRACER_AVX)
+	RAYTRACER_TARGET_AVX float intersectClusterAVX(unsigned int cluster, const Clusters& q, unsigned int* lane) const {
+		const unsigned int first = cluster*cluster_size;
+		const float* px = &cx[first];
+		const float* py = &cy[first];
+		const float* pz = &cz[first];
+		const float* pr2 = &radius2[first];
+		const float infinity = std::numeric_limits<float>::infinity();
+
+		const __m256 ox = _mm256_set1_ps(q.origin.x), oy = _mm256_set1_ps(q.origin.y), oz = _mm256_set1_ps(q.origin.z);
+		const __m256 dx = _mm256_set1_ps(q.dir.x), dy = _mm256_set1_ps(q.dir.y), dz = _mm256_set1_ps(q.dir.z);
+		const __m256 a = _mm256_set1_ps(q.a), inv_a = _mm256_set1_ps(q.inv_a), t_near = _mm256_set1_ps(q.t_near);
+		const __m256 zero = _mm256_setzero_ps(), none = _mm256_set1_ps(infinity);
+		__m256 t[2];
+		for (unsigned int h=0; h<2; ++h) {
+			const unsigned int k = 8*h;
+			__m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(px+k), ox);
+			__m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(py+k), oy);
+			__m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(pz+k), oz);
+			__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+			__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+				_mm256_loadu_ps(pr2+k));
+			__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+			__m256 real = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+			if (_mm256_movemask_ps(real) == 0) {
+				t[h] = none;
+				continue;
+			}
+			__m256 s = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+			__m256 t_close = _mm256_mul_ps(_mm256_sub_ps(b, s), inv_a);
+			__m256 t_far = _mm256_mul_ps(_mm256_add_ps(b, s), inv_a);
+			__m256 t_hit = _mm256_blendv_ps(t_far, t_close, _mm256_cmp_ps(t_close, t_near, _CMP_GT_OQ));
+			__m256 valid = _mm256_and_ps(real, _mm256_cmp_ps(t_hit, t_near, _CMP_GT_OQ));
+			t[h] = _mm256_blendv_ps(none, t_hit, valid);
+		}
+		__m256 m = _mm256_min_ps(t[0], t[1]);
+		__m128 m4 = _mm_min_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+		float t_min = horizontalMin(m4);
+		if (t_min == infinity) return -1.0f;
+		if (lane != NULL) {
+			const __m256 best = _mm256_set1_ps(t_min);
+			*lane = firstLane(static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t[0], best, _CMP_EQ_OQ)))
+				| static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t[1], best, _CMP_EQ_OQ))) << 8);
+		}
+		return t_min;
+	}
+#endif
+
+#if defined(RAYTRACER_SSE)
+	inline float intersectClusterSSE(unsigned int cluster, const Clusters& q, unsigned int* lane) const {
+		const unsigned int first = cluster*cluster_size;
+		const float* px = &cx[first];
+		const float* py = &cy[first];
+		const float* pz = &cz[first];
+		const float* pr2 = &radius2[first];
+		const float infinity = std::numeric_limits<float>::infinity();
+
+		const __m128 ox = _mm_set1_ps(q.origin.x), oy = _mm_set1_ps(q.origin.y), oz = _mm_set1_ps(q.origin.z);
+		const __m128 dx = _mm_set1_ps(q.dir.x), dy = _mm_set1_ps(q.dir.y), dz = _mm_set1_ps(q.dir.z);
+		const __m128 a = _mm_set1_ps(q.a), inv_a = _mm_set1_ps(q.inv_a), t_near = _mm_set1_ps(q.t_near);
+		const __m128 zero = _mm_setzero_ps(), none = _mm_set1_ps(infinity);
+		__m128 t[4];
+		for (unsigned int h=0; h<4; ++h) {
+			const unsigned int k = 4*h;
+			__m128 ocx = _mm_sub_ps(_mm_loadu_ps(px+k), ox);
+			__m128 ocy = _mm_sub_ps(_mm_loadu_ps(py+k), oy);
+			__m128 ocz = _mm_sub_ps(_mm_loadu_ps(pz+k), oz);
+			__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+			__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+				_mm_loadu_ps(pr2+k));
+			__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+			__m128 real = _mm_cmpge_ps(disc, zero);
+			if (_mm_movemask_ps(real) == 0) {
+				t[h] = none;
+				continue;
+			}
+			__m128 s = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+			__m128 t_close = _mm_mul_ps(_mm_sub_ps(b, s), inv_a);
+			__m128 t_far = _mm_mul_ps(_mm_add_ps(b, s), inv_a);
+			__m128 use_close = _mm_cmpgt_ps(t_close, t_near);
+			__m128 t_hit = _mm_or_ps(_mm_and_ps(use_close, t_close), _mm_andnot_ps(use_close, t_far));
+			__m128 valid = _mm_and_ps(real, _mm_cmpgt_ps(t_hit, t_near));
+			t[h] = _mm_or_ps(_mm_and_ps(valid, t_hit), _mm_andnot_ps(valid, none));
+		}
+		float t_min = horizontalMin(_mm_min_ps(_mm_min_ps(t[0], t[1]), _mm_min_ps(t[2], t[3])));
+		if (t_min == infinity) return -1.0f;
+		if (lane != NULL) {
+			const __m128 best = _mm_set1_ps(t_min);
+			unsigned int mask = 0;
+			for (unsigned int h=0; h<4; ++h) {
+				mask |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmpeq_ps(t[h], best))) << 4*h;
+			}
+			*lane = firstLane(mask);
+		}
+		return t_min;
+	}
+#endif
+
+#if defined(RAYTRACER_SSE)
+	static inline float horizontalMin(__m128 m) {
+		m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(m);
+	}
+#endif
+
+	static inline unsigned int firstLane(unsigned int mask) {
+		unsigned int lane = 0;
+		while ((mask & 1u) == 0 && lane < cluster_size-1) {
+			mask >>= 1;
+			++lane;
+		}
+		return lane;
+	}
+
+	unsigned int sphere_count;
+	std::vector<float> cx, cy, cz, radius2;
+	std::vector<unsigned int> ids; //< Sphere number in the input of each stored sphere
+	BVH bvh;
+	AABB bounds;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef _THREADPOOL_HPP__
+#define _THREADPOOL_HPP__
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <exception>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "SIMD.hpp"
+
+/**
+  * A fixed team of threads that is started once and runs one job after
+  * another, such as the tiles of a frame, the loops of a BVH build or the
+  * conversion of a frame to an image. Between jobs the threads first spin
+  * for a while, since jobs often come back to back, and then sleep until
+  * the next job, so an idle pool costs no CPU time.
+  *
+  * The thread calling run() takes part as thread 0, so a pool of n threads
+  * starts n-1 threads of its own.
+  */
+class ThreadPool {
+public:
+	/**
+	  * @param thread_count Threads to run jobs on, including the caller of
+	  *        run(), or 0 for one per hardware thread
+	  * @param pin_threads Whether to pin thread k of the pool to logical CPU
+	  *        k, so the OS does not move threads away from their caches. The
+	  *        thread calling run() is left where it is.
+	  */
+	ThreadPool(unsigned int thread_count = 0, bool pin_threads = false)
+		: generation(0), pending(0), job(NULL), stopping(false) {
+		if (thread_count == 0) thread_count = std::max(1u, boost::thread::hardware_concurrency());
+		this->thread_count = thread_count;
+		for (unsigned int thread=1; thread<thread_count; ++thread) {
+			workers.push_back(std::shared_ptr<boost::thread>(new boost::thread(&ThreadPool::work, this, thread)));
+			if (pin_threads) pin(*workers.back(), thread);
+		}
+	}
+
+	~ThreadPool() {
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			stopping = true;
+			generation.fetch_add(1);
+		}
+		wake.notify_all();
+		for (unsigned int k=0; k<workers.size(); ++k) workers[k]->join();
+	}
+
+	inline unsigned int getThreadCount() const { return thread_count; }
+
+	/**
+	  * Runs job(thread) once on every thread of the pool, for thread 0 to
+	  * getThreadCount()-1, and returns when all are done. The caller runs
+	  * job(0). The first exception thrown by a job is thrown again from here.
+	  * Jobs must not call run() on the pool they run on.
+	  */
+	void run(const std::function<void (unsigned int)>& job) {
+		error = std::exception_ptr();
+		if (thread_count > 1) {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			this->job = &job;
+			pending.store(thread_count-1);
+			generation.fetch_add(1);
+		}
+		wake.notify_all();
+
+		runJob(job, 0);
+
+		if (thread_count > 1) {
+			for (unsigned int spin=0; spin<spin_count && pending.load() > 0; ++spin) pause();
+			boost::unique_lock<boost::mutex> lock(mutex);
+			while (pending.load() > 0) finished.wait(lock);
+			this->job = NULL;
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	/**
+	  * Runs body(i) for every i from begin up to end, spread over the threads
+	  * in chunks, which threads that finish early take more of
+	  */
+	template <class Body>
+	void parallelFor(int begin, int end, const Body& body) {
+		if (end <= begin) return;
+		const int chunk = std::max(1, (end-begin)/static_cast<int>(8*thread_count));
+		boost::atomic<int> next(begin);
+		run([&](unsigned int) {
+			for (int first = next.fetch_add(chunk); first < end; first = next.fetch_add(chunk)) {
+				const int last = std::min(first+chunk, end);
+				for (int i=first; i<last; ++i) body(i);
+			}
+		});
+	}
+
+private:
+	/**
+	  * Rounds a thread spins for the next job, or for the others to finish,
+	  * before it sleeps. Some tens of microseconds.
+	  */
+	static const unsigned int spin_count = 10000;
+
+	static inline void pause() {
+#if defined(RAYTRACER_SSE)
+		_mm_pause();
+#else
+		boost::this_thread::yield();
+#endif
+	}
+
+	static void pin(boost::thread& thread, unsigned int cpu) {
+		const unsigned int cpus = std::max(1u, boost::thread::hardware_concurrency());
+		cpu %= cpus;
+#ifdef _WIN32
+		//Without processor groups, only the first 64 CPUs can be pinned to
+		if (cpu < 64) SetThreadAffinityMask(thread.native_handle(), static_cast<DWORD_PTR>(1) << cpu);
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+	}
+
+	void work(unsigned int thread) {
+		unsigned int seen = 0;
+		for (;;) {
+			unsigned int current = generation.load();
+			for (unsigned int spin=0; spin<spin_count && current == seen; ++spin) {
+				pause();
+				current = generation.load();
+			}
+			if (current == seen) {
+				boost::unique_lock<boost::mutex> lock(mutex);
+				while ((current = generation.load()) == seen) wake.wait(lock);
+			}
+			seen = current;
+
+			const std::function<void (unsigned int)>* next_job;
+			{
+				boost::lock_guard<boost::mutex> lock(mutex);
+				if (stopping) return;
+				next_job = job;
+			}
+			runJob(*next_job, thread);
+
+			if (pending.fetch_sub(1) == 1) {
+				boost::lock_guard<boost::mutex> lock(mutex);
+				finished.notify_all();
+			}
+		}
+	}
+
+	inline void runJob(const std::function<void (unsigned int)>& job, unsigned int thread) {
+		try {
+			job(thread);
+		}
+		catch (...) {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (!error) error = std::current_exception();
+		}
+	}
+
+	unsigned int thread_count;
+	std::vector<std::shared_ptr<boost::thread> > workers;
+	boost::atomic<unsigned int> generation; //< Counts the jobs started
+	boost::atomic<unsigned int> pending;    //< Threads other than the caller still running the job
+	const std::function<void (unsigned int)>* job;
+	bool stopping;
+	std::exception_ptr error;
+	boost::mutex mutex;
+	boost::condition_variable wake;
+	boost::condition_variable finished;
+};
+
+/**
+  * Runs body(i) for every i from begin up to end on the threads of pool, or
+  * on OpenMP threads when pool is NULL, as for objects built on their own
+  * outside a RayTracer
+  */
+template <class Body>
+inline void parallelFor(ThreadPool* pool, int begin, int end, const Body& body) {
+	if (pool != NULL) {
+		pool->parallelFor(begin, end, body);
+		return;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i=begin; i<end; ++i) {
+		body(i);
+	}
+}
+
+/**
+  * Returns the number of threads parallelFor() uses with pool
+  */
+inline unsigned int threadCount(ThreadPool* pool) {
+	if (pool != NULL) return pool->getThreadCount();
+#ifdef _OPENMP
+	return static_cast<unsigned int>(omp_get_max_threads());
+#else
+	return 1;
+#endif
+}
+
+#endif
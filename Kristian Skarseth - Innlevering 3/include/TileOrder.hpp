@@ -0,0 +1,94 @@
+#ifndef _TILEORDER_HPP__
+#define _TILEORDER_HPP__
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace tiles {
+	/**
+	  * The order the screen tiles are handed out in. Each thread renders a run
+	  * of consecutive tiles of the order, so along a space filling curve the
+	  * tiles a thread renders one after another are neighbours on the screen,
+	  * and find the BVH nodes and texels of the tile before still in cache.
+	  */
+	enum Order {
+		RowMajor, //< Left to right, top to bottom
+		Morton,   //< Z-order curve
+		Hilbert   //< Hilbert curve, which unlike the Z-order never jumps between neighbours
+	};
+
+	inline const char* name(Order order) {
+		switch (order) {
+		case Morton: return "Morton";
+		case Hilbert: return "Hilbert";
+		default: return "row major";
+		}
+	}
+
+	namespace detail {
+		/**
+		  * Interleaves the bits of x and y, x in the even bits
+		  */
+		inline unsigned int mortonIndex(unsigned int x, unsigned int y) {
+			unsigned int index = 0;
+			for (unsigned int bit=0; bit<16; ++bit) {
+				index |= ((x >> bit) & 1u) << (2*bit);
+				index |= ((y >> bit) & 1u) << (2*bit+1);
+			}
+			return index;
+		}
+
+		/**
+		  * Distance of (x, y) along the Hilbert curve through an n by n square,
+		  * where n is a power of two
+		  */
+		inline unsigned int hilbertIndex(unsigned int n, unsigned int x, unsigned int y) {
+			unsigned int index = 0;
+			for (unsigned int s=n/2; s>0; s/=2) {
+				const unsigned int rx = (x & s) ? 1 : 0;
+				const unsigned int ry = (y & s) ? 1 : 0;
+				index += s*s*((3*rx) ^ ry);
+				//Turn the quadrant so the curve within it starts at its origin
+				if (ry == 0) {
+					if (rx == 1) {
+						x = n-1-x;
+						y = n-1-y;
+					}
+					std::swap(x, y);
+				}
+			}
+			return index;
+		}
+	}
+
+	/**
+	  * Returns the tiles of a tiles_x by tiles_y screen, numbered row by row, in
+	  * the given order. The curves are laid over the smallest power of two square
+	  * that holds the screen, and skip the tiles outside it.
+	  */
+	inline std::vector<unsigned int> sequence(unsigned int tiles_x, unsigned int tiles_y, Order order) {
+		const unsigned int count = tiles_x*tiles_y;
+		std::vector<unsigned int> tiles(count);
+		if (order == RowMajor) {
+			for (unsigned int tile=0; tile<count; ++tile) tiles[tile] = tile;
+			return tiles;
+		}
+
+		unsigned int n = 1;
+		while (n < tiles_x || n < tiles_y) n *= 2;
+
+		std::vector<std::pair<unsigned int, unsigned int> > keys(count);
+		for (unsigned int tile=0; tile<count; ++tile) {
+			const unsigned int x = tile%tiles_x;
+			const unsigned int y = tile/tiles_x;
+			keys[tile].first = (order == Morton) ? detail::mortonIndex(x, y) : detail::hilbertIndex(n, x, y);
+			keys[tile].second = tile;
+		}
+		std::sort(keys.begin(), keys.end());
+		for (unsigned int k=0; k<count; ++k) tiles[k] = keys[k].second;
+		return tiles;
+	}
+}
+
+#endif
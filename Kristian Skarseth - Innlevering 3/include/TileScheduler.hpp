@@ -0,0 +1,113 @@
+#ifndef _TILESCHEDULER_HPP__
+#define _TILESCHEDULER_HPP__
+
+#include <boost/atomic.hpp>
+
+#include "CacheLineArray.hpp"
+
+/**
+  * Hands out the tiles 0 to tile_count-1 to a fixed number of threads, with
+  * work stealing. Every thread owns a deque of tiles, which starts out as an
+  * even share of consecutive tiles, and takes tiles from its front, so
+  * neighbouring tiles are rendered by the same thread one after another. A
+  * thread whose deque runs dry steals the back half of the fullest deque of
+  * another thread. Threads only touch each other's deques when they run out
+  * of work, so the cost of balancing is paid at the end of the frame, where
+  * the expensive tiles would otherwise leave cores idle.
+  *
+  * The tiles of a deque are always a range [begin, end), packed in one 64 bit
+  * word, so taking from the front and stealing from the back are both a single
+  * compare and swap, without locks.
+  *
+  * References:
+  *				Robert D. Blumofe, Charles E. Leiserson. 1999. Scheduling Multithreaded Computations by Work Stealing
+  */
+class TileScheduler {
+public:
+	TileScheduler(unsigned int tile_count, unsigned int thread_count)
+		: thread_count(thread_count), deques(thread_count) {
+		for (unsigned int t=0; t<thread_count; ++t) {
+			const unsigned int begin = static_cast<unsigned int>((static_cast<unsigned long long>(tile_count)*t)/thread_count);
+			const unsigned int end = static_cast<unsigned int>((static_cast<unsigned long long>(tile_count)*(t+1))/thread_count);
+			deques[t].range = pack(begin, end);
+		}
+	}
+
+	/**
+	  * Takes the next tile for thread, from its own deque or else by stealing
+	  * @return false once no tiles are left to any thread
+	  */
+	inline bool next(unsigned int thread, unsigned int& tile) {
+		if (takeFront(deques[thread].range, tile)) return true;
+		while (steal(thread)) {
+			if (takeFront(deques[thread].range, tile)) return true;
+		}
+		return false;
+	}
+
+private:
+	typedef unsigned long long Range;
+
+	/**
+	  * Padded to a cache line, and kept in a CacheLineArray so every deque has
+	  * a line of its own and the owner taking tiles does not slow down the
+	  * other threads
+	  */
+	struct Deque {
+		Deque() : range(0) {}
+		boost::atomic<Range> range;
+		char padding[64 - sizeof(boost::atomic<Range>)];
+	};
+
+	static inline Range pack(unsigned int begin, unsigned int end) { return (static_cast<Range>(end) << 32) | begin; }
+	static inline unsigned int begin(Range range) { return static_cast<unsigned int>(range); }
+	static inline unsigned int end(Range range) { return static_cast<unsigned int>(range >> 32); }
+	static inline unsigned int size(Range range) { return end(range) - begin(range); }
+
+	static inline bool takeFront(boost::atomic<Range>& deque, unsigned int& tile) {
+		Range range = deque.load();
+		while (size(range) > 0) {
+			if (deque.compare_exchange_weak(range, pack(begin(range)+1, end(range)))) {
+				tile = begin(range);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	  * Moves the back half of the fullest other deque into the empty deque of
+	  * thread. Only the owner fills its deque, so it can be stored directly.
+	  * Tiles on their way between deques are briefly in neither, but then the
+	  * thief is still running and renders them.
+	  * @return false if all other deques were found empty
+	  */
+	inline bool steal(unsigned int thread) {
+		for (;;) {
+			unsigned int victim = thread;
+			Range victim_range = 0;
+			for (unsigned int k=1; k<thread_count; ++k) {
+				const unsigned int t = (thread+k)%thread_count;
+				Range range = deques[t].range.load();
+				if (size(range) > size(victim_range)) {
+					victim = t;
+					victim_range = range;
+				}
+			}
+			if (victim == thread) return false;
+
+			const unsigned int half = (size(victim_range)+1)/2;
+			const unsigned int split = end(victim_range) - half;
+			if (deques[victim].range.compare_exchange_strong(victim_range, pack(begin(victim_range), split))) {
+				deques[thread].range.store(pack(split, end(victim_range)));
+				return true;
+			}
+			//The victim or another thief got there first, look again
+		}
+	}
+
+	unsigned int thread_count;
+	CacheLineArray<Deque> deques;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef _TRIANGLEINTERSECTION_HPP__
+#define _TRIANGLEINTERSECTION_HPP__
+
+#include <cmath>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+#include "Ray.hpp"
+
+/**
+  * Watertight ray/triangle test, shared by Triangle and TriangleMesh. The
+  * corners are moved into a sheared space where the ray runs along the z axis,
+  * and the hit test is the sign of three 2D edge functions there. Triangles
+  * sharing a corner or an edge transform and evaluate it exactly the same way,
+  * so no ray can slip through the crack between them. The shear is scaled by
+  * the ray direction instead of divided by it, so the only division left is
+  * for the distance of an actual hit.
+  * @param barycentric If not NULL, set to the weights of p0, p1 and p2 at the hit
+  * @return The ray parameter of the hit, or -1 if the ray misses
+  *
+  * References:
+  *				Sven Woop, Carsten Benthin, Ingo Wald. 2013. Watertight Ray/Triangle Intersection
+  */
+inline float intersectTriangle(const Ray& r, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2,
+	glm::vec3* barycentric = NULL) {
+	const glm::vec3& origin = r.getOrigin();
+	const glm::vec3& dir = r.getDirection();
+
+	//The axis the ray moves fastest along becomes z
+	const float abs_x = fabs(dir.x);
+	const float abs_y = fabs(dir.y);
+	const float abs_z = fabs(dir.z);
+	const int kz = (abs_x > abs_y) ? ((abs_x > abs_z) ? 0 : 2) : ((abs_y > abs_z) ? 1 : 2);
+	const int kx = (kz == 2) ? 0 : kz+1;
+	const int ky = (kz == 0) ? 2 : kz-1;
+	const float dx = dir[kx];
+	const float dy = dir[ky];
+	const float dz = dir[kz];
+
+	const glm::vec3 a = p0 - origin;
+	const glm::vec3 b = p1 - origin;
+	const glm::vec3 c = p2 - origin;
+
+	//Corners sheared onto the plane through the origin facing the ray, times dz
+	const float ax = a[kx]*dz - dx*a[kz];
+	const float ay = a[ky]*dz - dy*a[kz];
+	const float bx = b[kx]*dz - dx*b[kz];
+	const float by = b[ky]*dz - dy*b[kz];
+	const float cx = c[kx]*dz - dx*c[kz];
+	const float cy = c[ky]*dz - dy*c[kz];
+
+	//Edge functions, which are barycentric coordinates scaled by the same factor
+	float e0 = cx*by - cy*bx;
+	float e1 = ax*cy - ay*cx;
+	float e2 = bx*ay - by*ax;
+	const float e_min = glm::min(e0, glm::min(e1, e2));
+	const float e_max = glm::max(e0, glm::max(e1, e2));
+	if (e_min < 0.0f && e_max > 0.0f) {
+		return -1.0f; //The ray passes outside one of the edges
+	}
+	if (e_min == 0.0f || e_max == 0.0f) {
+		//The ray goes through an edge or a corner, where float rounding decides
+		//the sign, so redo them exactly in double precision
+		e0 = static_cast<float>(static_cast<double>(cx)*by - static_cast<double>(cy)*bx);
+		e1 = static_cast<float>(static_cast<double>(ax)*cy - static_cast<double>(ay)*cx);
+		e2 = static_cast<float>(static_cast<double>(bx)*ay - static_cast<double>(by)*ax);
+		if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)) {
+			return -1.0f;
+		}
+	}
+
+	const float det = e0 + e1 + e2;
+	if (det == 0.0f) {
+		return -1.0f; //The ray is parallel to the triangle, or the triangle has no area
+	}
+
+	//t is scaled_t/(det*dz), so a hit behind the origin has opposite signs
+	const float scaled_t = e0*a[kz] + e1*b[kz] + e2*c[kz];
+	const float scale = det*dz;
+	if ((scaled_t < 0.0f) != (scale < 0.0f)) {
+		return -1.0f;
+	}
+	if (barycentric != NULL) {
+		*barycentric = glm::vec3(e0, e1, e2)/det;
+	}
+	return scaled_t/scale;
+}
+
+#endif
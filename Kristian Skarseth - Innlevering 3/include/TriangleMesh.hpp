@@ -0,0 +1,181 @@
+#ifndef _TRIANGLEMESH_HPP__
+#define _TRIANGLEMESH_HPP__
+
+#include <vector>
+#include <memory>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+
+#include "RayTracerState.hpp"
+#include "SceneObject.hpp"
+#include "SceneObjectEffect.hpp"
+#include "TriangleIntersection.hpp"
+#include "BVH.hpp"
+
+/**
+  * A mesh of triangles sharing one effect, stored as one scene object. The
+  * vertex positions (and optional vertex normals) are kept as separate x, y
+  * and z arrays, and triangles are three indices into them, so a corner shared
+  * by several triangles is stored once and no triangle is an object of its own.
+  * A million triangle mesh takes about 60 bytes per triangle including its BVH,
+  * against about 200 for separate Triangle objects in the scene BVH.
+  *
+  * The mesh has its own BVH over its triangles, and the triangles are stored in
+  * the order of its leaves, so a leaf reads its triangles from consecutive memory.
+  */
+class TriangleMesh : public SceneObject {
+public:
+	/**
+	  * Creates a flat shaded mesh
+	  * @param vertices Corner positions shared between the triangles
+	  * @param indices Three vertex indices per triangle, counter clockwise (as in openGL)
+	  * @throws std::runtime_error if an index is outside vertices
+	  */
+	TriangleMesh(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices,
+		std::shared_ptr<SceneObjectEffect> effect)
+		: SceneObject(effect)
+	{
+		setVertices(vertices);
+		build(indices);
+	}
+
+	/**
+	  * Creates a smooth shaded mesh, with the vertex normals interpolated over each triangle
+	  * @param normals One normal per vertex
+	  * @throws std::runtime_error if an index is outside vertices, or the normal count is wrong
+	  */
+	TriangleMesh(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals,
+		const std::vector<unsigned int>& indices, std::shared_ptr<SceneObjectEffect> effect)
+		: SceneObject(effect)
+	{
+		if (normals.size() != vertices.size()) {
+			throw std::runtime_error("TriangleMesh needs one normal per vertex");
+		}
+		setVertices(vertices);
+		nx.resize(normals.size());
+		ny.resize(normals.size());
+		nz.resize(normals.size());
+		for (unsigned int i=0; i<normals.size(); ++i) {
+			nx[i] = normals[i].x;
+			ny[i] = normals[i].y;
+			nz[i] = normals[i].z;
+		}
+		build(indices);
+	}
+
+	float intersect(const Ray& r) {
+		const float z_offset = glm::max(10e-4f, r.getMinT());
+		float t_min = r.getMaxT();
+		unsigned int triangle;
+		if (bvh.intersect(r, z_offset, t_min, triangle, Faces(*this))) {
+			return t_min;
+		}
+		return -1.0f;
+	}
+
+	/**
+	  * The hit triangle is not passed on from intersect, so the mesh is walked
+	  * once more to find it and the barycentric coordinates of the hit. The
+	  * triangle is reported as its position in the index array given to the
+	  * constructor.
+	  */
+	void computeHit(const Ray& r, HitRecord& hit) {
+		const float z_offset = glm::max(10e-4f, r.getMinT());
+		float t_min = std::numeric_limits<float>::max();
+		unsigned int triangle;
+		hit.position = r.getOrigin() + hit.t*r.getDirection();
+		if (!bvh.intersect(r, z_offset, t_min, triangle, Faces(*this))) {
+			return;
+		}
+		const unsigned int* corner = &indices[3*triangle];
+		glm::vec3 weights;
+		intersectFace(triangle, r, &weights);
+		hit.primitive = ids[triangle];
+		hit.uv = glm::vec2(weights.y, weights.z);
+		if (nx.empty()) {
+			hit.normal = glm::normalize(glm::cross(vertex(corner[1])-vertex(corner[0]), vertex(corner[2])-vertex(corner[0])));
+		}
+		else {
+			hit.normal = glm::normalize(weights.x*normal(corner[0]) + weights.y*normal(corner[1]) + weights.z*normal(corner[2]));
+		}
+	}
+
+	glm::vec3 rayTrace(Ray &ray, const HitRecord& hit, RayTracerState& state) {
+		return effect->rayTrace(ray, hit, state);
+	}
+
+	AABB getBoundingBox() {
+		return bounds;
+	}
+
+	inline unsigned int getTriangleCount() const { return static_cast<unsigned int>(indices.size()/3); }
+	inline unsigned int getVertexCount() const { return static_cast<unsigned int>(x.size()); }
+
+private:
+	/**
+	  * Lets the BVH traversal intersect the triangles of the mesh
+	  */
+	struct Faces {
+		Faces(const TriangleMesh& mesh) : mesh(mesh) {}
+		inline float intersect(unsigned int triangle, const Ray& r) const { return mesh.intersectFace(triangle, r, NULL); }
+		const TriangleMesh& mesh;
+	};
+
+	void setVertices(const std::vector<glm::vec3>& vertices) {
+		x.resize(vertices.size());
+		y.resize(vertices.size());
+		z.resize(vertices.size());
+		for (unsigned int i=0; i<vertices.size(); ++i) {
+			x[i] = vertices[i].x;
+			y[i] = vertices[i].y;
+			z[i] = vertices[i].z;
+		}
+	}
+
+	/**
+	  * Builds the BVH over the triangles, and stores the triangles in leaf order
+	  */
+	void build(const std::vector<unsigned int>& input) {
+		const unsigned int triangle_count = static_cast<unsigned int>(input.size()/3);
+		std::vector<AABB> boxes(triangle_count);
+		for (unsigned int k=0; k<triangle_count; ++k) {
+			for (unsigned int c=0; c<3; ++c) {
+				if (input[3*k+c] >= x.size()) {
+					throw std::runtime_error("TriangleMesh index outside the vertex array");
+				}
+				boxes[k].extend(vertex(input[3*k+c]));
+			}
+			bounds.extend(boxes[k]);
+		}
+		bvh.build(boxes);
+
+		const unsigned int* order = bvh.getIndexData();
+		indices.resize(3*triangle_count);
+		ids.assign(order, order+triangle_count);
+		for (unsigned int i=0; i<triangle_count; ++i) {
+			for (unsigned int c=0; c<3; ++c) {
+				indices[3*i+c] = input[3*order[i]+c];
+			}
+		}
+		bvh.useLeafOrder();
+	}
+
+	inline glm::vec3 vertex(unsigned int i) const { return glm::vec3(x[i], y[i], z[i]); }
+	inline glm::vec3 normal(unsigned int i) const { return glm::vec3(nx[i], ny[i], nz[i]); }
+
+	inline float intersectFace(unsigned int triangle, const Ray& r, glm::vec3* weights) const {
+		const unsigned int* corner = &indices[3*triangle];
+		return intersectTriangle(r, vertex(corner[0]), vertex(corner[1]), vertex(corner[2]), weights);
+	}
+
+	std::vector<float> x, y, z;
+	std::vector<float> nx, ny, nz;
+	std::vector<unsigned int> indices;
+	std::vector<unsigned int> ids; //< Triangle number in the input of each stored triangle
+	BVH bvh;
+	AABB bounds;
+};
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef _WIDEBVH_HPP__
+#define _WIDEBVH_HPP__
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "SIMD.hpp"
+#include "AABB.hpp"
+#include "Ray.hpp"
+#include "BVH.hpp"
+#include "SceneObject.hpp"
+
+/**
+  * A node with up to Width children. The child boxes are stored as separate
+  * arrays per coordinate (structure of arrays), so one SIMD instruction can
+  * work on the same coordinate of 4 or 8 boxes. Unused slots get an empty box
+  * and are masked out by valid_mask, since swapping min and max in the slab
+  * test would otherwise turn an inverted box into one covering everything.
+  *
+  * A child reference with the high bit clear is the index of another node,
+  * with the high bit set the low bits index the leaf array.
+  */
+template <unsigned int Width>
+struct WideBVHNode {
+	float min_x[Width], min_y[Width], min_z[Width];
+	float max_x[Width], max_y[Width], max_z[Width];
+	unsigned int child[Width];
+	unsigned int valid_mask;
+
+	static const unsigned int leaf_flag = 0x80000000u;
+};
+
+/**
+  * A run of primitives referenced from a leaf slot in a wide node
+  */
+struct WideBVHLeaf {
+	unsigned int offset;
+	unsigned int count;
+};
+
+/**
+  * BVH with 4 or 8 children per node, made by collapsing a binary BVH. Each
+  * traversal step tests the ray against all children of a node at once and
+  * pushes the ones that were hit near to far, so there are fewer steps and
+  * fewer hard to predict branches than with the binary tree.
+  *
+  * References:
+  *				Ingo Wald, Carsten Benthin, Solomon Boulos. 2008. Getting Rid of Packets: Efficient SIMD Single-Ray Traversal using Multi-branching BVHs
+  *				Manfred Ernst, Gunther Greiner. 2008. Multi Bounding Volume Hierarchies
+  */
+template <unsigned int Width>
+class WideBVH {
+public:
+	typedef WideBVHNode<Width> Node;
+
+	WideBVH() : node_data(NULL), node_count(0), leaf_data(NULL), leaf_count(0), binary(NULL) {}
+
+	/**
+	  * Collapses the binary hierarchy into nodes of Width children. Starting with
+	  * the two children of a binary node, the interior child with the largest
+	  * surface area is repeatedly replaced by its own two children until the node
+	  * is full, so the boxes most likely to be hit are the ones opened up.
+	  */
+	void build(const BVH& binary) {
+		clear();
+		this->binary = &binary;
+		const BVHNode* binary_nodes = binary.getNodeData();
+		if (binary.empty()) return;
+
+		nodes.reserve(binary.getNodeCount()/(Width/2) + 1);
+		nodes.push_back(Node());
+		if (binary_nodes[0].isLeaf()) {
+			//A single leaf still needs a node above it to be traversed
+			unsigned int children[1] = { 0 };
+			fillNode(0, binary_nodes, children, 1);
+		}
+		else {
+			collapse(0, binary_nodes, 0);
+		}
+		useOwnedStorage();
+	}
+
+	/**
+	  * Uses nodes and leaves stored elsewhere, normally in a memory mapped cache
+	  * file. Leaves index the primitive order of binary, which must stay alive.
+	  */
+	void attach(const BVH& binary, const Node* node_array, unsigned int node_array_count,
+		const WideBVHLeaf* leaf_array, unsigned int leaf_array_count, std::shared_ptr<MappedFile> storage) {
+		clear();
+		this->binary = &binary;
+		node_data = node_array;
+		node_count = node_array_count;
+		leaf_data = leaf_array;
+		leaf_count = leaf_array_count;
+		mapping = storage;
+	}
+
+	void clear() {
+		nodes.clear();
+		leaves.clear();
+		mapping.reset();
+		binary = NULL;
+		useOwnedStorage();
+	}
+
+	inline bool empty() const { return node_count == 0; }
+	inline const Node* getNodeData() const { return node_data; }
+	inline unsigned int getNodeCount() const { return node_count; }
+	inline const WideBVHLeaf* getLeafData() const { return leaf_data; }
+	inline unsigned int getLeafCount() const { return leaf_count; }
+
+	/**
+	  * Finds the closest intersection along ray, with the same contract as BVH::intersect
+	  */
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, SceneObject*& hit) const {
+		unsigned int index;
+		if (!intersect(ray, t_near, t_min, index, ObjectPrimitives(binary))) return false;
+		hit = binary->getObject(index);
+		return true;
+	}
+
+	/**
+	  * Any hit query with the same contract as BVH::occluded
+	  */
+	inline bool occluded(const Ray& ray, float t_near, float t_max) const {
+		return occluded(ray, t_near, t_max, ObjectPrimitives(binary));
+	}
+
+	/**
+	  * Finds the closest intersection along ray, with the same contract as the
+	  * BVH::intersect taking primitives. hit is set to an index of the binary tree.
+	  */
+	template <class Primitives>
+	inline bool intersect(const Ray& ray, float t_near, float& t_min, unsigned int& hit, const Primitives& primitives) const {
+		if (node_count == 0) return false;
+
+		const glm::vec3 origin = ray.getOrigin();
+		const glm::vec3 inv_dir = ray.getInvDirection();
+		const simd::Level level = simd::level();
+
+		bool found = false;
+		unsigned int stack[BVH::max_depth*Width];
+		float stack_t[BVH::max_depth*Width];
+		unsigned int stack_size = 0;
+		stack[stack_size] = 0;
+		stack_t[stack_size++] = 0.0f;
+
+		while (stack_size > 0) {
+			--stack_size;
+			//The child was hit when pushed, but a closer hit may have been found since
+			if (stack_t[stack_size] > t_min) continue;
+			unsigned int ref = stack[stack_size];
+
+			if (ref & Node::leaf_flag) {
+				const WideBVHLeaf& leaf = leaf_data[ref & ~Node::leaf_flag];
+				const unsigned int* index = binary->getIndexData();
+				for (unsigned int i=leaf.offset; i<leaf.offset+leaf.count; ++i) {
+					float t = primitives.intersect(index[i], ray);
+					if (t > t_near && t <= t_min) {
+						t_min = t;
+						hit = index[i];
+						found = true;
+					}
+				}
+				continue;
+			}
+
+			float t_enter[Width];
+			unsigned int mask = intersectChildren(node_data[ref], origin, inv_dir, t_min, t_enter, level) & node_data[ref].valid_mask;
+
+			//Sort the hit children far to near, and push them so the nearest is popped first
+			unsigned int hits[Width];
+			unsigned int hit_count = 0;
+			for (unsigned int c=0; c<Width; ++c) {
+				if (!(mask & (1u << c))) continue;
+				unsigned int k = hit_count++;
+				while (k > 0 && t_enter[hits[k-1]] < t_enter[c]) {
+					hits[k] = hits[k-1];
+					--k;
+				}
+				hits[k] = c;
+			}
+			for (unsigned int k=0; k<hit_count; ++k) {
+				stack[stack_size] = node_data[ref].child[hits[k]];
+				stack_t[stack_size++] = t_enter[hits[k]];
+			}
+		}
+		return found;
+	}
+
+	/**
+	  * Any hit query with the same contract as the BVH::occluded taking primitives.
+	  * The order children are visited in does not matter here, so they are
+	  * pushed unsorted.
+	  */
+	template <class Primitives>
+	inline bool occluded(const Ray& ray, float t_near, float t_max, const Primitives& primitives) const {
+		if (node_count == 0) return false;
+
+		const glm::vec3 origin = ray.getOrigin();
+		const glm::vec3 inv_dir = ray.getInvDirection();
+		const simd::Level level = simd::level();
+
+		unsigned int stack[BVH::max_depth*Width];
+		unsigned int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0) {
+			unsigned int ref = stack[--stack_size];
+
+			if (ref & Node::leaf_flag) {
+				const WideBVHLeaf& leaf = leaf_data[ref & ~Node::leaf_flag];
+				const unsigned int* index = binary->getIndexData();
+				for (unsigned int i=leaf.offset; i<leaf.offset+leaf.count; ++i) {
+					float t = primitives.intersect(index[i], ray);
+					if (t > t_near && t < t_max) return true;
+				}
+				continue;
+			}
+
+			float t_enter[Width];
+			unsigned int mask = intersectChildren(node_data[ref], origin, inv_dir, t_max, t_enter, level) & node_data[ref].valid_mask;
+			for (unsigned int c=0; c<Width; ++c) {
+				if (mask & (1u << c)) stack[stack_size++] = node_data[ref].child[c];
+			}
+		}
+		return false;
+	}
+
+	/**
+	  * Tests the ray against all child boxes of node, with the widest kernel
+	  * of level
+	  * @param t_enter Set to the entry distance of every child
+	  * @return Bit c is set if child c was hit between 0 and t_max
+	  */
+	static inline unsigned int intersectChildren(const Node& node, const glm::vec3& origin,
+		const glm::vec3& inv_dir, float t_max, float* t_enter, simd::Level level) {
+#if defined(RAYTRACER_AVX)
+		if (Width == 8 && level >= simd::AVX) return intersectChildrenAVX(node, origin, inv_dir, t_max, t_enter);
+#endif
+#if defined(RAYTRACER_SSE)
+		if (level >= simd::SSE) return intersectChildrenSSE(node, origin, inv_dir, t_max, t_enter);
+#endif
+		unsigned int mask = 0;
+		for (unsigned int c=0; c<Width; ++c) {
+			AABB box(glm::vec3(node.min_x[c], node.min_y[c], node.min_z[c]), glm::vec3(node.max_x[c], node.max_y[c], node.max_z[c]));
+			glm::vec3 t1 = (box.min-origin)*inv_dir;
+			glm::vec3 t2 = (box.max-origin)*inv_dir;
+			glm::vec3 t_small = glm::min(t1, t2);
+			glm::vec3 t_large = glm::max(t1, t2);
+			t_enter[c] = glm::max(glm::max(t_small.x, t_small.y), glm::max(t_small.z, 0.0f));
+			float t_exit = glm::min(glm::min(t_large.x, t_large.y), glm::min(t_large.z, t_max));
+			if (t_enter[c] <= t_exit) mask |= 1u << c;
+		}
+		return mask;
+	}
+
+private:
+#if defined(RAYTRACER_SSE)
+	static inline unsigned int intersectChildrenSSE(const Node& node, const glm::vec3& origin,
+		const glm::vec3& inv_dir, float t_max, float* t_enter) {
+		const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+		const __m128 ix = _mm_set1_ps(inv_dir.x), iy = _mm_set1_ps(inv_dir.y), iz = _mm_set1_ps(inv_dir.z);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 limit = _mm_set1_ps(t_max);
+		unsigned int mask = 0;
+		for (unsigned int c=0; c<Width; c+=4) {
+			__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x+c), ox), ix);
+			__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x+c), ox), ix);
+			__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y+c), oy), iy);
+			__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y+c), oy), iy);
+			__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z+c), oz), iz);
+			__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z+c), oz), iz);
+			__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)),
+				_mm_max_ps(_mm_min_ps(tz1, tz2), zero));
+			__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)),
+				_mm_min_ps(_mm_max_ps(tz1, tz2), limit));
+			_mm_storeu_ps(t_enter+c, t0);
+			mask |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << c;
+		}
+		return mask;
+	}
+#endif
+
+#if defined(RAYTRACER_AVX)
+	/**
+	  * Only used for 8 children, as the first 8 slots are tested
+	  */
+	RAYTRACER_TARGET_AVX static unsigned int intersectChildrenAVX(const Node& node, const glm::vec3& origin,
+		const glm::vec3& inv_dir, float t_max, float* t_enter) {
+		const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+		const __m256 ix = _mm256_set1_ps(inv_dir.x), iy = _mm256_set1_ps(inv_dir.y), iz = _mm256_set1_ps(inv_dir.z);
+		__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_x), ox), ix);
+		__m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_x), ox), ix);
+		__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_y), oy), iy);
+		__m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_y), oy), iy);
+		__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_z), oz), iz);
+		__m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_z), oz), iz);
+		__m256 t0 = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)),
+			_mm256_max_ps(_mm256_min_ps(tz1, tz2), _mm256_setzero_ps()));
+		__m256 t1 = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)),
+			_mm256_min_ps(_mm256_max_ps(tz1, tz2), _mm256_set1_ps(t_max)));
+		_mm256_storeu_ps(t_enter, t0);
+		return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+	}
+#endif
+
+	/**
+	  * Lets the traversal templates intersect the scene objects of the binary tree
+	  */
+	struct ObjectPrimitives {
+		ObjectPrimitives(const BVH* binary) : binary(binary) {}
+		inline float intersect(unsigned int index, const Ray& ray) const { return binary->getObject(index)->intersect(ray); }
+		const BVH* binary;
+	};
+
+	/**
+	  * Fills wide node node_index from the binary node binary_index, recursing into
+	  * the interior children that are left after opening up the largest ones
+	  */
+	void collapse(unsigned int node_index, const BVHNode* binary_nodes, unsigned int binary_index) {
+		unsigned int children[Width];
+		unsigned int count = 0;
+		children[count++] = binary_index+1;
+		children[count++] = binary_nodes[binary_index].offset;
+
+		while (count < Width) {
+			int largest = -1;
+			float largest_area = -1.0f;
+			for (unsigned int c=0; c<count; ++c) {
+				const BVHNode& child = binary_nodes[children[c]];
+				if (!child.isLeaf() && child.bounds.surfaceArea() > largest_area) {
+					largest_area = child.bounds.surfaceArea();
+					largest = static_cast<int>(c);
+				}
+			}
+			if (largest < 0) break;
+			unsigned int opened = children[largest];
+			children[largest] = opened+1;
+			children[count++] = binary_nodes[opened].offset;
+		}
+
+		fillNode(node_index, binary_nodes, children, count);
+	}
+
+	void fillNode(unsigned int node_index, const BVHNode* binary_nodes, const unsigned int* children, unsigned int count) {
+		const float big = std::numeric_limits<float>::max();
+		nodes[node_index].valid_mask = (1u << count)-1;
+		for (unsigned int c=0; c<Width; ++c) {
+			Node& node = nodes[node_index];
+			if (c >= count) {
+				node.min_x[c] = node.min_y[c] = node.min_z[c] = big;
+				node.max_x[c] = node.max_y[c] = node.max_z[c] = -big;
+				node.child[c] = Node::leaf_flag;
+				continue;
+			}
+
+			const BVHNode& child = binary_nodes[children[c]];
+			node.min_x[c] = child.bounds.min.x;
+			node.min_y[c] = child.bounds.min.y;
+			node.min_z[c] = child.bounds.min.z;
+			node.max_x[c] = child.bounds.max.x;
+			node.max_y[c] = child.bounds.max.y;
+			node.max_z[c] = child.bounds.max.z;
+
+			if (child.isLeaf()) {
+				WideBVHLeaf leaf = { child.offset, child.count };
+				node.child[c] = Node::leaf_flag | static_cast<unsigned int>(leaves.size());
+				leaves.push_back(leaf);
+			}
+			else {
+				//nodes may reallocate here, so node is looked up again every iteration
+				unsigned int child_index = static_cast<unsigned int>(nodes.size());
+				nodes.push_back(Node());
+				nodes[node_index].child[c] = child_index;
+				collapse(child_index, binary_nodes, children[c]);
+			}
+		}
+	}
+
+	WideBVH(const WideBVH&);
+	WideBVH& operator=(const WideBVH&);
+
+	void useOwnedStorage() {
+		node_data = nodes.empty() ? NULL : &nodes[0];
+		node_count = static_cast<unsigned int>(nodes.size());
+		leaf_data = leaves.empty() ? NULL : &leaves[0];
+		leaf_count = static_cast<unsigned int>(leaves.size());
+	}
+
+	//Storage for trees collapsed in memory
+	std::vector<Node> nodes;
+	std::vector<WideBVHLeaf> leaves;
+
+	//What traversal reads: either the vectors above or a mapped cache file
+	const Node* node_data;
+	unsigned int node_count;
+	const WideBVHLeaf* leaf_data;
+	unsigned int leaf_count;
+	std::shared_ptr<MappedFile> mapping;
+
+	//The binary tree this was collapsed from, which owns the primitive order
+	const BVH* binary;
+};
+
+#endif
@@ -4,18 +4,37 @@
 #include <sstream>
 #include <iomanip>
 #include <limits>
+#include <algorithm>
+#include <cstdlib>
 #include <sys/stat.h>
-#include <omp.h>
 
 #include <IL/il.h>
 #include <IL/ilu.h>
 
 #include "CubeMap.hpp"
+#include "Timer.h"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+#include "Quad.hpp"
+#include "PrimitiveStore.hpp"
+#include "TileScheduler.hpp"
+#include "RenderProgress.hpp"
+#include "TileOrder.hpp"
+#include "Cache.hpp"
+
+/**
+  * The primitive types intersected without virtual calls by default
+  */
+typedef prim::List<Sphere, prim::List<Triangle, prim::List<Quad> > > BuiltinPrimitives;
 
 /**
 * References: http://www.codermind.com/articles/Raytracer-in-C++-Part-III-Textures.html
 */
-RayTracer::RayTracer(unsigned int width, unsigned int height) {
+RayTracer::RayTracer(unsigned int width, unsigned int height)
+	: progress_callback(&RayTracer::printProgress), progress_interval(1.0),
+	  render_start(Timer::getCurrentTime()), render_pixels(0), render_samples(0), render_done(true),
+	  tile_size(0), fitted_tile_size(0), tile_order(tiles::Hilbert),
+	  progressive(false), progressive_seconds(0.0), progressive_samples(64) {
 	const glm::vec3 camera_position(0.0f, 0.0f, 10.0f);
 
 	//Initialize framebuffer and virtual screen
@@ -28,6 +47,21 @@ RayTracer::RayTracer(unsigned int width, unsigned int height) {
 
 	//Initialize state
 	state.reset(new RayTracerState(camera_position));
+	setThreadCount(0);
+	setPrimitiveStore(std::shared_ptr<PrimitiveDispatch>(new PrimitiveStore<BuiltinPrimitives>()));
+
+	//Pick the SIMD kernels for this CPU, unless a lower level is asked for
+	const char* forced = std::getenv("RAYTRACER_SIMD");
+	simd::Level level;
+	if (forced != NULL) {
+		if (!simd::parse(forced, level)) {
+			throw std::runtime_error("Unknown SIMD level in RAYTRACER_SIMD: " + std::string(forced));
+		}
+		setSIMDLevel(level);
+	}
+	else {
+		std::cout << "Using " << simd::name(simd::level()) << " kernels" << std::endl;
+	}
 
 	//Initialize IL and ILU
 	ilInit();
@@ -35,41 +69,403 @@ RayTracer::RayTracer(unsigned int width, unsigned int height) {
 }
 
 void RayTracer::addSceneObject(std::shared_ptr<SceneObject>& o) {
-	state->getScene().push_back(o);
+	state->addSceneObject(o);
 }
 
 void RayTracer::addLightSource(std::shared_ptr<LightObject>& light){
 	state->getLights().push_back(light);
 }
 
+void RayTracer::setEnvironment(std::shared_ptr<Environment>& environment){
+	state->setEnvironment(environment);
+	fitted_tile_size = 0;
+}
+
+void RayTracer::setAccelerator(accel::Type type) {
+	state->setAccelerator(type);
+}
+
+void RayTracer::setBVHBuildMode(bvh::BuildMode mode) {
+	state->setBuildMode(mode);
+}
+
+void RayTracer::setBVHWidth(unsigned int width) {
+	state->setBVHWidth(width);
+}
+
+void RayTracer::setBVHCacheDirectory(std::string directory) {
+	state->setCacheDirectory(directory);
+}
+
+void RayTracer::setPrimitiveStore(std::shared_ptr<PrimitiveDispatch> store) {
+	state->setPrimitiveStore(store);
+}
+
+void RayTracer::setTileSize(unsigned int size) {
+	tile_size = size;
+}
+
+void RayTracer::setTileOrder(tiles::Order order) {
+	tile_order = order;
+}
+
+void RayTracer::setProgressive(bool progressive, double seconds, unsigned int samples) {
+	if (samples == 0) {
+		throw std::runtime_error("A progressive render needs at least one sample per pixel");
+	}
+	this->progressive = progressive;
+	progressive_seconds = seconds;
+	progressive_samples = std::min(samples, progressive_grid_size*progressive_grid_size);
+}
+
+void RayTracer::setThreadCount(unsigned int count, bool pin_threads) {
+	//The old threads are stopped before the new ones start
+	pool.reset();
+	pool.reset(new ThreadPool(count, pin_threads));
+	progress.reset(new ProgressCounters(pool->getThreadCount()));
+	state->setThreadPool(pool);
+}
+
+void RayTracer::setSIMDLevel(simd::Level level) {
+	simd::Level used = simd::setLevel(level);
+	std::cout << "Using " << simd::name(used) << " kernels";
+	if (used != simd::supported()) {
+		std::cout << " (forced, " << simd::name(simd::supported()) << " supported)";
+	}
+	else if (used != level) {
+		std::cout << " (" << simd::name(level) << " not supported)";
+	}
+	std::cout << std::endl;
+}
+
+void RayTracer::refitScene() {
+	Timer refit_timer;
+	bool rebuilt = state->refit();
+	if (rebuilt) fitted_tile_size = 0;
+	std::cout << (rebuilt ? "Rebuilt" : "Refitted") << (state->isUsingGrid() ? " grid" : " BVH") << " in "
+		<< refit_timer.elapsed() << " seconds" << std::endl;
+}
+
+void RayTracer::freezeScene() {
+	if (state->isFrozen()) return;
+	Timer build_timer;
+	state->freeze();
+	fitted_tile_size = 0;
+	if (state->isUsingGrid()) {
+		std::cout << "Built grid (" << state->getGrid().getCellCount() << " cells) in "
+			<< build_timer.elapsed() << " seconds" << std::endl;
+	}
+	else {
+		std::cout << (state->isLoadedFromCache() ? "Loaded" : "Built") << " BVH ("
+			<< state->getBVH().getNodeCount() << " nodes) in "
+			<< build_timer.elapsed() << " seconds" << std::endl;
+	}
+}
+
+unsigned int RayTracer::fitTileSize() {
+	const std::size_t budget = cache::l2Size()/2;
+	const unsigned int node_limit = static_cast<unsigned int>(budget/sizeof(BVHNode));
+
+	//Texels the environment spans per pixel, near the middle of the screen
+	const Environment* environment = state->getEnvironment();
+	const float texels_per_pixel = (environment == NULL) ? 0.0f
+		: environment->getTexelDensity()*(screen.right-screen.left)/fb->getWidth();
+
+	unsigned int size = 64;
+	for (; size > 8; size /= 2) {
+		//The heaviest of a 4 by 4 spread of tiles over the screen
+		const unsigned int tiles_x = (fb->getWidth()+size-1)/size;
+		const unsigned int tiles_y = (fb->getHeight()+size-1)/size;
+		std::size_t largest = 0;
+		for (unsigned int y=0; y<4; ++y) {
+			for (unsigned int x=0; x<4; ++x) {
+				const unsigned int i0 = ((tiles_x-1)*x/3)*size;
+				const unsigned int j0 = ((tiles_y-1)*y/3)*size;
+				const unsigned int i1 = std::min(i0+size, fb->getWidth());
+				const unsigned int j1 = std::min(j0+size, fb->getHeight());
+
+				std::size_t bytes = 0;
+				if (!state->isUsingGrid()) {
+					bytes += state->getBVH().countVisible(tileFrustum(i0, j0, i1, j1), node_limit)*sizeof(BVHNode);
+				}
+				if (texels_per_pixel > 0.0f) {
+					//Bilinear lookups read one texel beyond the footprint
+					const std::size_t side = static_cast<std::size_t>(size*texels_per_pixel) + 2;
+					bytes += side*side*3*sizeof(float);
+				}
+				largest = std::max(largest, bytes);
+			}
+		}
+		if (largest <= budget) break;
+	}
+	return size;
+}
+
 void RayTracer::render() {
-	//For every pixel, ray-trace using multiple CPUs
-	unsigned int rendered_pixels = 0;
-	float progress = 0.0f;
-	const unsigned int total_pixels = fb->getWidth()*fb->getHeight();
-	float next_target = lerp(0, total_pixels, 0.01f);
+	//Build the acceleration structure before any rays are fired
+	freezeScene();
+	unsigned int size = tile_size;
+	if (size == 0) {
+		if (fitted_tile_size == 0) {
+			fitted_tile_size = fitTileSize();
+			std::cout << "Using " << fitted_tile_size << "x" << fitted_tile_size << " pixel tiles for a "
+				<< cache::l2Size()/1024 << " KiB L2 cache" << std::endl;
+		}
+		size = fitted_tile_size;
+	}
+
+	//For every pixel, ray-trace on the threads of the pool. Every thread counts its
+	//own pixels, and a monitor thread sums and reports them. A progressive
+	//render counts every pixel once per pass.
+	const unsigned int passes = progressive ? progressive_samples : 1;
+	{
+		boost::lock_guard<boost::mutex> lock(progress_mutex);
+		progress->reset();
+		render_start = Timer::getCurrentTime();
+		render_pixels = static_cast<unsigned long long>(fb->getWidth())*fb->getHeight()*passes;
+		render_samples = 0;
+		render_done = false;
+	}
+	boost::thread monitor;
+	if (progress_callback) {
+		monitor = boost::thread(&RayTracer::monitorProgress, this);
+	}
 
-#ifdef _OPENMP
-#pragma omp parallel for
-	for (int j=0; j<static_cast<int>(fb->getHeight()); ++j) {
-#else
-	for (unsigned int j=0; j<fb->getHeight(); ++j) {
-#endif
-		for (unsigned int i=0; i<fb->getWidth(); ++i) {
-			
-			rendered_pixels++;
+	//The screen is rendered in square tiles. The primary rays of a tile all
+	//lie in one small frustum, so the parts of the scene outside it are culled
+	//once per tile instead of being rejected again by every ray
+	const unsigned int tiles_x = (fb->getWidth()+size-1)/size;
+	const unsigned int tiles_y = (fb->getHeight()+size-1)/size;
 
-			if(omp_get_thread_num() == 0){
-				if(rendered_pixels >= next_target){
-					progress+=1.0f;
-					next_target = lerp(0, total_pixels, (progress+1.0f)/100.0f);
-					std::cout << progress << "%" << std::endl;
-				}
+	//Every thread starts on its own run of neighbouring tiles, and steals
+	//tiles from the others when it runs out, so no core idles while tiles
+	//that are expensive to render remain. Runs of the tile order are
+	//neighbours on the screen, and so share BVH nodes and texels in cache.
+	const std::vector<unsigned int> order = tiles::sequence(tiles_x, tiles_y, tile_order);
+
+	if (!progressive) {
+		renderPass(order, tiles_x, size, -1);
+		boost::lock_guard<boost::mutex> lock(progress_mutex);
+		render_samples = static_cast<unsigned int>(sample_64x_array_length);
+	}
+	else {
+		//The frame buffer holds a complete image from the first pass on. A pass
+		//is only started if it is expected to end within the budget, taking as
+		//long as the pass before it, so the render ends on a pass boundary.
+		//A pass that is slower than the one before runs past the budget.
+		accumulation.resize(static_cast<std::size_t>(fb->getWidth())*fb->getHeight());
+		Timer budget_timer;
+		double pass_seconds = 0.0;
+		for (unsigned int pass=0; pass<passes; ++pass) {
+			if (pass > 0 && progressive_seconds > 0.0 && budget_timer.elapsed() + pass_seconds > progressive_seconds) {
+				//The passes left out are not part of the render, so it ends at 100%
+				boost::lock_guard<boost::mutex> lock(progress_mutex);
+				render_pixels = static_cast<unsigned long long>(fb->getWidth())*fb->getHeight()*render_samples;
+				break;
 			}
-				fb->setPixel(i,j, raytrace_64x_multisampled(i, j));
+			Timer pass_timer;
+			renderPass(order, tiles_x, size, static_cast<int>(pass));
+			pass_seconds = pass_timer.elapsed();
+			boost::lock_guard<boost::mutex> lock(progress_mutex);
+			render_samples = pass+1;
 		}
+	}
+
+	{
+		boost::lock_guard<boost::mutex> lock(progress_mutex);
+		render_done = true;
+	}
+	render_finished.notify_all();
+	if (monitor.joinable()) monitor.join();
+	if (progress_callback) progress_callback(getProgress());
+}
+
+void RayTracer::renderPass(const std::vector<unsigned int>& order, unsigned int tiles_x, unsigned int size, int pass) {
+	TileScheduler scheduler(static_cast<unsigned int>(order.size()), pool->getThreadCount());
+
+	pool->run([&](unsigned int thread) {
+		std::vector<unsigned int> entries;
+		std::vector<Ray> rays;
+		std::vector<glm::vec3> colors;
+		unsigned int next;
+		while (scheduler.next(thread, next)) {
+			const unsigned int tile = order[next];
+			const unsigned int i0 = (tile%tiles_x)*size;
+			const unsigned int j0 = (tile/tiles_x)*size;
+			const unsigned int i1 = std::min(i0+size, fb->getWidth());
+			const unsigned int j1 = std::min(j0+size, fb->getHeight());
+
+			const bool culled = state->cull(tileFrustum(i0, j0, i1, j1), entries);
+
+			if (pass < 0) {
+				for (unsigned int j=j0; j<j1; ++j) {
+					for (unsigned int i=i0; i<i1; ++i) {
+						fb->setPixel(i,j, raytrace_samples(i, j, sample_64x_values, sample_64x_array_length,
+							culled ? &entries : NULL, rays, colors));
+						progress->add(thread, 1, sample_64x_array_length);
+					}
+				}
+				continue;
+			}
+
+			//One sample per pixel, so the rays of a row of the tile are traced
+			//together, as packets of neighbouring pixels
+			const glm::vec2 offset = progressiveSample(pass);
+			const float weight = 1.0f/(pass+1);
+			for (unsigned int j=j0; j<j1; ++j) {
+				rays.clear();
+				for (unsigned int i=i0; i<i1; ++i) {
+					rays.push_back(primaryRay(i, j, offset));
+				}
+				colors.resize(rays.size());
+				state->rayTrace(rays.data(), static_cast<unsigned int>(rays.size()), colors.data(), culled ? &entries : NULL);
+
+				for (unsigned int i=i0; i<i1; ++i) {
+					glm::vec3& sum = accumulation[static_cast<std::size_t>(j)*fb->getWidth() + i];
+					sum = (pass == 0) ? colors[i-i0] : sum + colors[i-i0];
+					fb->setPixel(i, j, weight*sum);
+				}
+				progress->add(thread, i1-i0, i1-i0);
+			}
+		}
+	});
+}
+
+Ray RayTracer::primaryRay(unsigned int i, unsigned int j, const glm::vec2& offset) {
+	glm::vec3 dir(0, 0, -1.0f);
+	dir.x = (i+offset.x)*(screen.right-screen.left)/static_cast<float>(fb->getWidth()) + screen.left;
+	dir.y = (j+offset.y)*(screen.top-screen.bottom)/static_cast<float>(fb->getHeight()) + screen.bottom;
+	return Ray(state->getCamPos(), dir);
+}
+
+glm::vec2 RayTracer::progressiveSample(unsigned int pass) {
+	//The bits of pass, reversed and dealt out to x and y in turn over the 8 by
+	//8 cells, so the first 4 passes each take a quarter of the pixel, the
+	//first 16 each a sixteenth, and the image is evenly sampled after any pass.
+	//The cells are shifted by 3, which keeps that, so the first pass samples
+	//the cell next to the centre of the pixel instead of its corner.
+	const unsigned int n = progressive_grid_size;
+	unsigned int x = 0;
+	unsigned int y = 0;
+	for (unsigned int bit=0; bit<3; ++bit) {
+		x |= ((pass >> (2*bit)) & 1u) << (2-bit);
+		y |= ((pass >> (2*bit+1)) & 1u) << (2-bit);
+	}
+	x = (x+3)%n;
+	y = (y+3)%n;
+	return glm::vec2((x+0.5f)/n - 0.5f, (y+0.5f)/n - 0.5f);
+}
+
+std::vector<TileOrderProfile> RayTracer::profileTileOrders() {
+	freezeScene();
+	const tiles::Order orders[] = { tiles::RowMajor, tiles::Morton, tiles::Hilbert };
+	const tiles::Order kept_order = tile_order;
+	const ProgressCallback kept_callback = progress_callback;
+	progress_callback = ProgressCallback();
+
+	//The counters count the thread that opens them, so every thread of the
+	//pool opens its own
+	const unsigned int thread_count = pool->getThreadCount();
+	std::vector<std::shared_ptr<CacheCounters> > counters(thread_count);
+	std::vector<char> opened(thread_count, 0);
+	for (unsigned int t=0; t<thread_count; ++t) counters[t].reset(new CacheCounters());
+	pool->run([&](unsigned int thread) {
+		opened[thread] = counters[thread]->open();
+	});
+	const bool counting = std::find(opened.begin(), opened.end(), 0) == opened.end();
+	if (!counting) {
+		std::cout << "Cache counters not available, timing the tile orders only" << std::endl;
+	}
+
+	//An untimed frame first, which fits the tile size to the cache and warms
+	//the caches, so the first order is not measured under worse conditions
+	render();
+
+	std::vector<TileOrderProfile> profiles;
+	for (unsigned int k=0; k<sizeof(orders)/sizeof(orders[0]); ++k) {
+		tile_order = orders[k];
+		for (unsigned int t=0; t<thread_count; ++t) counters[t]->start();
+		Timer timer;
+		render();
+
+		TileOrderProfile profile;
+		profile.order = orders[k];
+		profile.seconds = timer.elapsed();
+		profile.l2_miss_rate = -1.0;
+		profile.l2_misses_per_ray = -1.0;
+		unsigned long long accesses = 0;
+		unsigned long long misses = 0;
+		for (unsigned int t=0; t<thread_count; ++t) {
+			counters[t]->stop();
+			counters[t]->read(accesses, misses);
+		}
+		const unsigned long long rays = getProgress().rays_traced;
+		if (counting && accesses > 0 && rays > 0) {
+			profile.l2_miss_rate = misses/static_cast<double>(accesses);
+			profile.l2_misses_per_ray = misses/static_cast<double>(rays);
+		}
+		profiles.push_back(profile);
+
+		std::cout << tiles::name(profile.order) << " tile order: " << profile.seconds << " seconds";
+		if (profile.l2_miss_rate >= 0.0) {
+			std::cout << ", L2 miss rate " << profile.l2_miss_rate*100.0 << "%, "
+				<< profile.l2_misses_per_ray << " L2 misses per ray";
+		}
+		std::cout << std::endl;
+	}
+
+	tile_order = kept_order;
+	progress_callback = kept_callback;
+	return profiles;
+}
+
+void RayTracer::setProgressCallback(ProgressCallback callback, double interval) {
+	progress_callback = callback;
+	progress_interval = interval;
+}
+
+RenderProgress RayTracer::getProgress() const {
+	RenderProgress report;
+	boost::lock_guard<boost::mutex> lock(progress_mutex);
+	progress->sum(report.pixels_done, report.rays_traced);
+	report.pixel_count = render_pixels;
+	report.samples_per_pixel = render_samples;
+	report.finished = render_done;
+	report.elapsed = Timer::getCurrentTime() - render_start;
+	if (report.elapsed > 0.0) {
+		report.rays_per_second = report.rays_traced/report.elapsed;
+	}
+	if (report.pixels_done > 0) {
+		report.eta = report.elapsed*(report.pixel_count - report.pixels_done)/report.pixels_done;
+	}
+	return report;
+}
+
+void RayTracer::monitorProgress() {
+	const boost::posix_time::milliseconds interval(static_cast<long>(progress_interval*1000.0));
+	boost::unique_lock<boost::mutex> lock(progress_mutex);
+	boost::system_time next_report = boost::get_system_time() + interval;
+	while (!render_done) {
+		//Waits again after a spurious wake up, until the report is due
+		if (render_finished.timed_wait(lock, next_report)) continue;
+		if (render_done) break;
+		//getProgress() takes the lock itself
+		lock.unlock();
+		progress_callback(getProgress());
+		lock.lock();
+		next_report = boost::get_system_time() + interval;
+	}
+}
+
+void RayTracer::printProgress(const RenderProgress& progress) {
+	std::cout << static_cast<int>(progress.getFraction()*100.0) << "% ("
+		<< static_cast<int>(progress.rays_per_second/1.0e5)/10.0 << "M rays/s, ";
+	if (progress.finished) {
+		std::cout << progress.elapsed << " seconds, " << progress.samples_per_pixel << " samples per pixel)" << std::endl;
+	}
+	else {
+		std::cout << static_cast<int>(progress.eta+0.5) << " seconds left)" << std::endl;
 	}
-	std::cout << "100%" << std::endl;
 }
 
 void RayTracer::save(std::string basename, std::string extension) {
@@ -83,8 +479,18 @@ void RayTracer::save(std::string basename, std::string extension) {
 	//Create image
 	ilGenImages(1, &texid);
 	ilBindImage(texid);
-	//FIXME: Ugly const cast:( DevILs fault, unfortunately
-	ilTexImage(fb->getWidth(), fb->getHeight(), 1, 3, IL_RGB, IL_FLOAT, const_cast<float*>(fb->getData().data()));
+	//Convert to 8 bits per channel on the pool, a row per task, instead of
+	//leaving it to DevIL on one thread. Clamped and truncated as DevIL does.
+	const int width = static_cast<int>(fb->getWidth());
+	const int height = static_cast<int>(fb->getHeight());
+	const std::vector<float>& data = fb->getData();
+	std::vector<ILubyte> pixels(3*width*height);
+	parallelFor(pool.get(), 0, height, [&](int j) {
+		for (int k=3*width*j; k<3*width*(j+1); ++k) {
+			pixels[k] = static_cast<ILubyte>(std::min(std::max(data[k], 0.0f), 1.0f)*255.0f);
+		}
+	});
+	ilTexImage(width, height, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, pixels.data());
 
 	//Find a unique filename...
 	for (i=0; i<10000; ++i) {
@@ -111,12 +517,19 @@ void RayTracer::save(std::string basename, std::string extension) {
 	ilDeleteImages(1, &texid);
 }
 
-float RayTracer::lerp( int i0, int i1, float t )
+Frustum RayTracer::tileFrustum( unsigned int i0, unsigned int j0, unsigned int i1, unsigned int j1 )
 {
-	float v0 = (float)i0;
-	float v1 = (float)i1;
-
-	return v0*(1.0f-t)+v1*t;
+	//The sample offsets reach half a pixel out from the pixel centres
+	const float x0 = (i0-1.0f)*(screen.right-screen.left)/static_cast<float>(fb->getWidth()) + screen.left;
+	const float x1 = (i1+0.0f)*(screen.right-screen.left)/static_cast<float>(fb->getWidth()) + screen.left;
+	const float y0 = (j0-1.0f)*(screen.top-screen.bottom)/static_cast<float>(fb->getHeight()) + screen.bottom;
+	const float y1 = (j1+0.0f)*(screen.top-screen.bottom)/static_cast<float>(fb->getHeight()) + screen.bottom;
+
+	const glm::vec3 corners[4] = {
+		glm::vec3(x0, y0, -1.0f), glm::vec3(x1, y0, -1.0f),
+		glm::vec3(x1, y1, -1.0f), glm::vec3(x0, y1, -1.0f)
+	};
+	return Frustum(state->getCamPos(), corners);
 }
 
 const glm::vec2 RayTracer::sample_16x_values[] = {
@@ -167,7 +580,10 @@ glm::vec3 RayTracer::raytrace_4x_multisampled( unsigned int i, unsigned int j )
 	glm::vec3 d4 = glm::vec3(x, y, z);
 	Ray r4 = Ray(state->getCamPos(), d4);
 
-	return 0.25f*(state->rayTrace(r1)+state->rayTrace(r2)+state->rayTrace(r3)+state->rayTrace(r4)) ;
+	Ray rays[4] = { r1, r2, r3, r4 };
+	glm::vec3 colors[4];
+	state->rayTrace(rays, 4, colors);
+	return 0.25f*(colors[0]+colors[1]+colors[2]+colors[3]);
 }
 
 glm::vec3 RayTracer::raytrace_1x_sampled( unsigned int i, unsigned int j )
@@ -183,31 +599,35 @@ glm::vec3 RayTracer::raytrace_1x_sampled( unsigned int i, unsigned int j )
 	return state->rayTrace(r1);
 }
 
-glm::vec3 RayTracer::raytrace_16x_multisampled( unsigned int i, unsigned int j )
+glm::vec3 RayTracer::raytrace_16x_multisampled( unsigned int i, unsigned int j, const std::vector<unsigned int>* entries )
 {
-	glm::vec3 dir(0, 0, -1.0f);
-	glm::vec3 color(0.0f);
+	std::vector<Ray> rays;
+	std::vector<glm::vec3> colors;
+	return raytrace_samples(i, j, sample_16x_values, sample_16x_array_length, entries, rays, colors);
+}
 
-	for(std::size_t t = 0; t < sample_16x_array_length; t++){
-		dir.x = (i+sample_16x_values[t].x)*(screen.right-screen.left)/static_cast<float>(fb->getWidth()) + screen.left;
-		dir.y = (j+sample_16x_values[t].y)*(screen.top-screen.bottom)/static_cast<float>(fb->getHeight()) + screen.bottom;
-		Ray ray = Ray(state->getCamPos(), dir);
-		color+=state->rayTrace(ray);
-	}
-	//Now do the ray-tracing to shade the pixel
-	return (1.0f/sample_16x_array_length)*color;
+glm::vec3 RayTracer::raytrace_64x_multisampled( unsigned int i, unsigned int j, const std::vector<unsigned int>* entries )
+{
+	std::vector<Ray> rays;
+	std::vector<glm::vec3> colors;
+	return raytrace_samples(i, j, sample_64x_values, sample_64x_array_length, entries, rays, colors);
 }
 
-glm::vec3 RayTracer::raytrace_64x_multisampled( unsigned int i, unsigned int j )
+glm::vec3 RayTracer::raytrace_samples( unsigned int i, unsigned int j, const glm::vec2* samples, std::size_t count,
+	const std::vector<unsigned int>* entries, std::vector<Ray>& rays, std::vector<glm::vec3>& colors )
 {
-	glm::vec3 dir(0, 0, -1.0f);
-	glm::vec3 color(0.0f);
+	rays.clear();
+	for(std::size_t t = 0; t < count; t++){
+		rays.push_back(primaryRay(i, j, samples[t]));
+	}
 
-	for(std::size_t t = 0; t < sample_64x_array_length; t++){
-		dir.x = (i+sample_64x_values[t].x)*(screen.right-screen.left)/static_cast<float>(fb->getWidth()) + screen.left;
-		dir.y = (j+sample_64x_values[t].y)*(screen.top-screen.bottom)/static_cast<float>(fb->getHeight()) + screen.bottom;
-		Ray ray = Ray(state->getCamPos(), dir);
-		color+=state->rayTrace(ray);
+	//The samples of a pixel are close together, so they are traced as packets
+	colors.resize(count);
+	state->rayTrace(rays.data(), static_cast<unsigned int>(count), colors.data(), entries);
+
+	glm::vec3 color(0.0f);
+	for(std::size_t t = 0; t < count; t++){
+		color+=colors[t];
 	}
-	return (1.0f/sample_64x_array_length)*color;
+	return (1.0f/count)*color;
 }
@@ -14,7 +14,7 @@
 #include "Light.hpp"
 #include "CubeMap.hpp"
 #include "Triangle.hpp"
-#include "SizedPlane.hpp"
+#include "Quad.hpp"
 
 #include "PhongEffect.hpp"
 #include "ColorEffect.hpp"
@@ -49,7 +49,8 @@ int main(int argc, char *argv[]) {
 		std::shared_ptr<LightObject> light3(new PointLight(glm::vec3(-1.0f, -5.0f, 9.0f)));
 		rt->addLightSource(light3);
 		
-	/*	srand(static_cast<int>(time(NULL)));
+	/*	rt->setBVHBuildMode(bvh::BuildSpeed); //Build time dominates for millions of spheres
+		srand(static_cast<int>(time(NULL)));
 		for (int i=0; i<10; ++i) {
 			float tx = (rand() / (float) RAND_MAX - 0.5f) *25;
 			float ty = (rand() / (float) RAND_MAX - 0.5f) *25;
@@ -59,10 +60,10 @@ int main(int argc, char *argv[]) {
 			rt->addSceneObject(s1);
 		}*/
 
-		std::shared_ptr<SceneObject> cubemap(new CubeMap(cubemap::SaintLazarusChurch));
-		rt->addSceneObject(cubemap);
+		std::shared_ptr<Environment> cubemap(new CubeMap(cubemap::SaintLazarusChurch));
+		rt->setEnvironment(cubemap);
 	
-		std::shared_ptr<SceneObject> myplane(new SizedPlane(
+		std::shared_ptr<SceneObject> myplane(new Quad(
 			glm::vec3(-1.0f, -10.0f, 5.0f),
 			glm::vec3(8.0f, -10.0f, 5.0f),
 			glm::vec3(8.0f, -10.0f, -30.0f),
@@ -102,35 +103,35 @@ int main(int argc, char *argv[]) {
 }
 
 void cubeplanes(RayTracer* rt, std::shared_ptr<SceneObjectEffect> effect){
-	std::shared_ptr<SceneObject> myplane(new SizedPlane(
+	std::shared_ptr<SceneObject> myplane(new Quad(
 		glm::vec3(-10.0f, -10.0f, 10.0f),
 		glm::vec3(-10.0f, -10.0f, -10.0f),
 		glm::vec3(-10.0f, 10.0f, -10.0f),
 		glm::vec3(-10.0f, 10.0f, 10.0f), effect));
 	rt->addSceneObject(myplane);
 
-	std::shared_ptr<SceneObject> myplane2(new SizedPlane(
+	std::shared_ptr<SceneObject> myplane2(new Quad(
 		glm::vec3(10.0f, -10.0f, -10.0f),
 		glm::vec3(10.0f, -10.0f, 10.0f),
 		glm::vec3(10.0f, 10.0f, 10.0f),
 		glm::vec3(10.0f, 10.0f, -10.0f), effect));
 	rt->addSceneObject(myplane2);
 
-	std::shared_ptr<SceneObject> myplane3(new SizedPlane(
+	std::shared_ptr<SceneObject> myplane3(new Quad(
 		glm::vec3(-10.0f, -10.0f, -10.0f),
 		glm::vec3(10.0f, -10.0f, -10.0f),
 		glm::vec3(10.0f, 10.0f, -10.0f),
 		glm::vec3(-10.0f, 10.0f, -10.0f), effect));
 	rt->addSceneObject(myplane3);
 
-	std::shared_ptr<SceneObject> myplane4(new SizedPlane(
+	std::shared_ptr<SceneObject> myplane4(new Quad(
 		glm::vec3(10.0f, -10.0f, 10.0f),
 		glm::vec3(-10.0f, -10.0f, 10.0f),
 		glm::vec3(-10.0f, 10.0f, 10.0f),
 		glm::vec3(10.0f, 10.0f, 10.0f), effect));
 	rt->addSceneObject(myplane4);
 
-	std::shared_ptr<SceneObject> myplane5(new SizedPlane(
+	std::shared_ptr<SceneObject> myplane5(new Quad(
 		glm::vec3(-10.0f, -10.0f, 10.0f),
 		glm::vec3(10.0f, -10.0f, 10.0f),
 		glm::vec3(10.0f, -10.0f, -10.0f),